@@ -18,33 +18,77 @@ KeyValuePair &KeyValuePair::operator=(const KeyValuePair &rhs) {
     return *(new(this) KeyValuePair(rhs));
 }
 
+BTreeMessage::BTreeMessage() : op(0) { }
+
+
+BTreeMessage::BTreeMessage(const SIZE_T o, const KEY_T &k, const VALUE_T &v) : op(o), key(k), value(v) { }
+
+
+SuperblockExt::SuperblockExt() {
+    memset(this, 0, sizeof(*this));
+    magic = BTREE_SUPERBLOCK_MAGIC;
+    fillpercent = 100;
+    redistribute = 1;
+    maxfanout = 16;
+}
+
 BTreeIndex::BTreeIndex(SIZE_T keysize, SIZE_T valuesize, BufferCache *cache, bool unique) {
     superblock.info.keysize = keysize;
     superblock.info.valuesize = valuesize;
     buffercache = cache;
+    readcache = 0;
+    bloom = 0;
+    leafcodec = 0;
+    appendrun = 0;
+    descendrun = 0;
     // note: ignoring unique now
 }
 
 BTreeIndex::BTreeIndex() {
-    // shouldn't have to do anything
+    readcache = 0;
+    bloom = 0;
+    leafcodec = 0;
+    appendrun = 0;
+    descendrun = 0;
 }
 
 
 //
 // Note, will not attach!
+// Nor will it share the read cache or the bloom filter, the copy starts
+// without either.  The filter's blocks belong to rhs, and inserts made
+// through the copy won't reach them, so they are marked stale.
 //
 BTreeIndex::BTreeIndex(const BTreeIndex &rhs) {
+    SuperblockExt ext;
+
     buffercache = rhs.buffercache;
     superblock_index = rhs.superblock_index;
     superblock = rhs.superblock;
+    GetSuperblockExt(ext);
+    ext.bloomclean = 0;
+    SetSuperblockExt(ext);
+    readcache = 0;
+    bloom = 0;
+    leafcodec = rhs.leafcodec ? new LeafCodec(*rhs.leafcodec) : 0;
+    appendrun = rhs.appendrun;
+    descendrun = rhs.descendrun;
 }
 
 BTreeIndex::~BTreeIndex() {
-    // shouldn't have to do anything
+    delete readcache;
+    delete bloom;
+    delete leafcodec;
 }
 
 
 BTreeIndex &BTreeIndex::operator=(const BTreeIndex &rhs) {
+    if (this == &rhs) {
+        return *this;
+    }
+    delete readcache;
+    delete bloom;
+    delete leafcodec;
     return *(new(this)BTreeIndex(rhs));
 }
 
@@ -84,6 +128,23 @@ ERROR_T BTreeIndex::DeallocateNode(const SIZE_T &n) {
 
 }
 
+void BTreeIndex::GetSuperblockExt(SuperblockExt &ext) const {
+    SuperblockExt stored;
+
+    memcpy(&stored, superblock.data, sizeof(stored));
+    if (stored.magic == BTREE_SUPERBLOCK_MAGIC) {
+        ext = stored;
+    } else {
+        ext = SuperblockExt();
+    }
+}
+
+
+void BTreeIndex::SetSuperblockExt(const SuperblockExt &ext) {
+    memcpy(superblock.data, &ext, sizeof(ext));
+}
+
+
 ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create) {
     ERROR_T errorMessage;
 
@@ -101,6 +162,9 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create) {
         newsuperblock.info.rootnode = superblock_index + 1;
         newsuperblock.info.freelist = superblock_index + 2;
         newsuperblock.info.numkeys = 0;
+        SuperblockExt ext;
+        ext.counted = 1;
+        memcpy(newsuperblock.data, &ext, sizeof(ext));
 
         buffercache->NotifyAllocateBlock(superblock_index);
 
@@ -140,12 +204,27 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create) {
     }
 
     // OK, now, mounting the btree is simply a matter of reading the superblock
-
-    return superblock.Unserialize(buffercache, initblock);
+    // and anything it points to
+
+    if ((errorMessage = superblock.Unserialize(buffercache, initblock))) return errorMessage;
+    // a read cache enabled before now may be keyed on the wrong keysize,
+    // or hold entries of another tree, so start it over
+    if (readcache) {
+        SIZE_T capacity = readcache->GetCapacity();
+        delete readcache;
+        readcache = new HotKeyCache(superblock.info.keysize, capacity);
+    }
+    delete leafcodec;
+    leafcodec = new LeafCodec(superblock.info.keysize, superblock.info.valuesize);
+    return ReadBloomFilter();
 }
 
 
 ERROR_T BTreeIndex::Detach(SIZE_T &initblock) {
+    ERROR_T errorMessage;
+
+    if ((errorMessage = RebuildStaleBloomFilter())) return errorMessage;
+    if (bloom && (errorMessage = WriteBloomFilter())) return errorMessage;
     return superblock.Serialize(buffercache, superblock_index);
 }
 
@@ -163,9 +242,48 @@ ERROR_T BTreeIndex::LookupOrUpdateInternal(const SIZE_T &node, const BTreeOp op,
         return errorMessage;
     }
 
+    // Lookups search a compressed leaf in place, updates decode it
+    if (dummy.info.nodetype == BTREE_COMPRESSED_LEAF_NODE) {
+        if (op == BTREE_OP_LOOKUP) {
+            return FindInCompressedLeaf(dummy, key, value);
+        }
+        if ((errorMessage = ReadNode(node, dummy))) return errorMessage;
+    }
+
     switch (dummy.info.nodetype) {
         case BTREE_ROOT_NODE:
         case BTREE_INTERIOR_NODE:
+            // A pending message here is newer than anything further down
+            if (op == BTREE_OP_LOOKUP) {
+                bool found, updated;
+                errorMessage = SearchMessages(dummy, key, value, found, updated);
+                if (found || errorMessage) { return errorMessage; }
+                if (updated) {
+                    // the update holds if the key is there further down
+                    VALUE_T newest(value);
+                    if (dummy.info.numkeys == 0) { return ERROR_NONEXISTENT; }
+                    if ((errorMessage = ChildPosition(dummy, key, position))) return errorMessage;
+                    if ((errorMessage = dummy.GetPtr(position, ptr))) return errorMessage;
+                    if ((errorMessage = LookupOrUpdateInternal(ptr, op, key, value))) return errorMessage;
+                    value = newest;
+                    return ERROR_NOERROR;
+                }
+            }
+            // an update with no room in its leaf is made again after
+            // making room, see MakeRoom
+            if (op == BTREE_OP_UPDATE) {
+                if (dummy.info.numkeys == 0) { return ERROR_NONEXISTENT; }
+                for (;;) {
+                    if ((errorMessage = ChildPosition(dummy, key, position))) return errorMessage;
+                    if ((errorMessage = dummy.GetPtr(position, ptr))) return errorMessage;
+                    errorMessage = LookupOrUpdateInternal(ptr, op, key, value);
+                    if (errorMessage != ERROR_SIZE) {
+                        return errorMessage;
+                    }
+                    if ((errorMessage = MakeRoom(node, position))) return errorMessage;
+                    if ((errorMessage = dummy.Unserialize(buffercache, node))) return errorMessage;
+                }
+            }
             // Scan through key/ptr pairs
             //and recurse if possible
             for (position = 0; position < dummy.info.numkeys; position++) {
@@ -200,7 +318,7 @@ ERROR_T BTreeIndex::LookupOrUpdateInternal(const SIZE_T &node, const BTreeOp op,
                         return dummy.GetVal(position, value);
                     } else {
                         if ((errorMessage = dummy.SetVal(position, value))) return errorMessage;
-                        return dummy.Serialize(buffercache, node);
+                        return WriteNode(node, dummy);
                     }
                 }
             }
@@ -309,321 +427,2364 @@ static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &dummy, BTreeDis
 
 
 ERROR_T BTreeIndex::Lookup(const KEY_T &key, VALUE_T &value) {
-    return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, value);
+    ERROR_T errorMessage;
+
+    if (readcache && readcache->Get(key, value)) {
+        return ERROR_NOERROR;
+    }
+    if (bloom && !bloom->MayContain(key)) {
+        return ERROR_NONEXISTENT;
+    }
+    errorMessage = LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, value);
+    if (readcache && errorMessage == ERROR_NOERROR) {
+        readcache->Put(key, value);
+    }
+    if (bloom && errorMessage == ERROR_NONEXISTENT) {
+        bloom->NoteFalsePositive();
+    }
+    return errorMessage;
 }
 
 
+ERROR_T BTreeIndex::EnableReadCache(const SIZE_T capacity) {
+    delete readcache;
+    readcache = 0;
+    if (capacity > 0) {
+        readcache = new HotKeyCache(superblock.info.keysize, capacity);
+    }
+    return ERROR_NOERROR;
+}
 
-ERROR_T BTreeIndex::SplitNode(const SIZE_T &node, SIZE_T &newNode, KEY_T &middle) {
-    BTreeNode leftNode, rightNode, leafnode;
-    SIZE_T leftKeyNum, rightKeyNum;
-    char *src, *dest;
-    ERROR_T errorMessage;
 
-    leftNode.Unserialize(buffercache, node);
-    rightNode = leftNode;
-    if ((errorMessage = AllocateNode(newNode))) return errorMessage;
-    leftKeyNum = leftNode.info.numkeys / 2 + 1;               //left = right + 1
-    rightKeyNum = leftNode.info.numkeys - leftKeyNum;
-    if (leftNode.info.nodetype == BTREE_LEAF_NODE) {
-        
-        leftNode.GetKey(leftKeyNum - 1, middle);                 // give split a value
-        src = leftNode.ResolveKeyVal(leftKeyNum);                  //last key in leftnode
-        dest = rightNode.ResolveKeyVal(0);                          //first key in rightnode
-        memmove(dest, src, rightKeyNum * (leftNode.info.keysize + leftNode.info.valuesize));
-    } else {
-        leftKeyNum = leftKeyNum -1;
-        rightKeyNum = rightKeyNum- 1;
-        leftNode.GetKey(leftKeyNum, middle);
-        src = leftNode.ResolvePtr(leftKeyNum + 1);
-        dest = rightNode.ResolvePtr(0);
-        memmove(dest, src, rightKeyNum * (leftNode.info.keysize + sizeof(SIZE_T)) + sizeof(SIZE_T));
+ERROR_T BTreeIndex::GetReadCacheStats(HotKeyCacheStats &stats) const {
+    if (!readcache) {
+        return ERROR_NONEXISTENT;
+    }
+    readcache->GetStats(stats);
+    return ERROR_NOERROR;
+}
 
 
+ERROR_T BTreeIndex::EnableBloomFilter(const SIZE_T numbits, const SIZE_T numhashes) {
+    ERROR_T errorMessage;
+    SuperblockExt ext;
+    SIZE_T node;
+    SIZE_T numblocks;
+    BTreeNode dummy(BTREE_BLOOM_BLOCK, superblock.info.keysize, superblock.info.valuesize,
+                    buffercache->GetBlockSize());
+
+    if ((errorMessage = FreeBloomBlocks())) return errorMessage;
+    delete bloom;
+    bloom = 0;
+
+    if (numbits > 0) {
+        // 7 probes is optimal at about 10 bits per key
+        bloom = new BloomFilter(superblock.info.keysize, numbits, numhashes ? numhashes : 7);
+        numblocks = (bloom->GetNumBytes() + dummy.info.GetNumDataBytes() - 1) / dummy.info.GetNumDataBytes();
+        for (SIZE_T i = 0; i < numblocks; i++) {
+            if ((errorMessage = AllocateNode(node))) {
+                FreeBloomBlocks();
+                delete bloom;
+                bloom = 0;
+                return errorMessage;
+            }
+            bloomblocks.push_back(node);
+        }
+        if ((errorMessage = RebuildBloomFilter())) return errorMessage;
     }
-    leftNode.info.numkeys = leftKeyNum;
-    rightNode.info.numkeys = rightKeyNum;
 
-    if ((errorMessage = leftNode.Serialize(buffercache, node))) return errorMessage;
-    if ((errorMessage = rightNode.Serialize(buffercache, newNode))) return errorMessage;
-    return ERROR_NOERROR;
+    GetSuperblockExt(ext);
+    ext.bloomblock = bloom ? bloomblocks[0] : 0;
+    ext.bloombits = bloom ? bloom->GetNumBits() : 0;
+    ext.bloomhashes = bloom ? bloom->GetNumHashes() : 0;
+    ext.bloomclean = 0;
+    SetSuperblockExt(ext);
+
+    if (bloom) {
+        return WriteBloomFilter();
+    }
+    return superblock.Serialize(buffercache, superblock_index);
 }
 
-//
-ERROR_T BTreeIndex::InsertOneNode(const SIZE_T node, const KEY_T &key, const VALUE_T &value, const SIZE_T &newNode) {
-    BTreeNode dummy;
-    KEY_T testkey;
-    SIZE_T numkeys;
-    SIZE_T position;
+
+ERROR_T BTreeIndex::RebuildBloomFilter() {
+    if (!bloom) {
+        return ERROR_NONEXISTENT;
+    }
     ERROR_T errorMessage;
-    KEY_T prevKey;
-    VALUE_T prevVal;
-    char *src,*dest;
+    SuperblockExt ext;
+    SIZE_T added;
+
+    bloom->Clear();
+    added = 0;
+    if ((errorMessage = BloomAddSubtree(superblock.info.rootnode, added))) return errorMessage;
+    GetSuperblockExt(ext);
+    ext.bloomkeys = added;
+    ext.bloomdeletes = 0;
+    ext.bloomstale = 0;
+    SetSuperblockExt(ext);
+    return ERROR_NOERROR;
+}
 
-    dummy.Unserialize(buffercache, node);
-    numkeys = dummy.info.numkeys;
 
-    dummy.info.numkeys++;
+ERROR_T BTreeIndex::GetBloomFilterStats(BloomFilterStats &stats) const {
+    if (!bloom) {
+        return ERROR_NONEXISTENT;
+    }
+    bloom->GetStats(stats);
+    return ERROR_NOERROR;
+}
 
-    if (dummy.info.numkeys == 1) {
-        if ((errorMessage = dummy.SetKey(0, key))) return errorMessage;
-        if ((errorMessage = dummy.SetVal(0, value))) return errorMessage;
-    } else {
-        for (position = 0; position < numkeys; position++) {
-            if ((errorMessage = dummy.GetKey(position, testkey))) return errorMessage;
-            if (key < testkey) {
-                src = dummy.ResolveKey(position);
-                dest = dummy.ResolveKey(position + 1);
-                if (dummy.info.nodetype == BTREE_LEAF_NODE) {
-                    for (int position2 = (int) dummy.info.numkeys - 2; position2 >= (int) position; position2--)
-              {
-                // grab old key and value
-                dummy.GetKey((SIZE_T) position2, prevKey);
-                dummy.GetVal((SIZE_T) position2, prevVal);
-                dummy.SetKeyVal((SIZE_T) position2 + 1, KeyValuePair(prevKey, prevVal));
-
-              }
-                    
-                  
-                    if ((errorMessage = dummy.SetKey(position, key))) return errorMessage;
-                    if ((errorMessage = dummy.SetVal(position, value))) return errorMessage;
-                } else {
-                    for (int position2 = (int) dummy.info.numkeys - 2; position2 >= (int) position; position2--)
-              {
-                // grab old key and value
-                dummy.GetKey((SIZE_T) position2, prevKey);
-                dummy.GetVal((SIZE_T) position2, prevVal);
-                dummy.SetKeyVal((SIZE_T) position2 + 1, KeyValuePair(prevKey, prevVal));
 
-              }
-                    if ((errorMessage = dummy.SetKey(position, key))) return errorMessage;
-                    if ((errorMessage = dummy.SetPtr(position + 1, newNode))) return errorMessage;
-                }
-                break;
-            }
-            if (position == numkeys - 1) {
-                if (dummy.info.nodetype == BTREE_LEAF_NODE) {
-                    if ((errorMessage = dummy.SetKey(numkeys, key))) return errorMessage;
-                    if ((errorMessage = dummy.SetVal(numkeys, value))) return errorMessage;
-                } else {
-                    if ((errorMessage = dummy.SetKey(numkeys, key))) return errorMessage;
-                    if ((errorMessage = dummy.SetPtr(numkeys + 1, newNode))) return errorMessage;
-                }
-                break;
-            }
-        }
+ERROR_T BTreeIndex::SetSplitPolicy(const SIZE_T fillpercent, const bool redistribute) {
+    SuperblockExt ext;
+
+    if (fillpercent < 50 || fillpercent > 100) {
+        return ERROR_SIZE;
     }
-    return dummy.Serialize(buffercache, node);
+    GetSuperblockExt(ext);
+    ext.fillpercent = fillpercent;
+    ext.redistribute = redistribute ? 1 : 0;
+    SetSuperblockExt(ext);
+    return superblock.Serialize(buffercache, superblock_index);
 }
 
 
-ERROR_T BTreeIndex::splitInsert(const SIZE_T &node, const KEY_T &key, const VALUE_T &value) {
-
+//
+// Add the keys in the leaves under node to the filter, and those of
+// buffered puts and inserts that haven't reached a leaf yet; added
+// counts them
+//
+ERROR_T BTreeIndex::BloomAddSubtree(const SIZE_T &node, SIZE_T &added) {
     BTreeNode dummy;
     ERROR_T errorMessage;
+    SuperblockExt ext;
+    vector<BTreeMessage> msgs;
     SIZE_T position;
     KEY_T testkey;
     SIZE_T ptr;
-    SIZE_T newNode;
-    KEY_T middle;
-    BTreeNode temp;
 
-    dummy.Unserialize(buffercache, node);
+    if ((errorMessage = ReadNode(node, dummy))) return errorMessage;
+
     switch (dummy.info.nodetype) {
         case BTREE_ROOT_NODE:
         case BTREE_INTERIOR_NODE:
-            for (position = 0; position < dummy.info.numkeys; position++) {
-                if ((errorMessage = dummy.GetKey(position, testkey))) return errorMessage;
-                if (key < testkey || key == testkey) {
-                    if ((errorMessage = dummy.GetPtr(position, ptr))) return errorMessage;
-                    if ((errorMessage = splitInsert(ptr, key, value))) return errorMessage;
-                     
-                    temp.Unserialize(buffercache, ptr);
-                    // dummy.info.GetNumSlotsAsLeaf();
-                    int interior =  temp.info.GetNumSlotsAsInterior();
-                    int leaf1 = temp.info.GetNumSlotsAsLeaf();
-                    // cout << "interior= " << interior<< endl;
-                    // cout << "leaf1= " << leaf1<< endl;
-                    if((temp.info.nodetype == BTREE_INTERIOR_NODE && temp.info.numkeys == temp.info.GetNumSlotsAsInterior()) || (temp.info.nodetype == BTREE_LEAF_NODE && temp.info.numkeys == temp.info.GetNumSlotsAsLeaf())) 
-                    {
-                        if ((errorMessage = SplitNode(ptr, newNode, middle))) return errorMessage;
-                        return InsertOneNode(node, middle, VALUE_T(), newNode);
+            GetSuperblockExt(ext);
+            if (ext.buffered) {
+                if ((errorMessage = ReadMessages(dummy, msgs))) return errorMessage;
+                for (SIZE_T i = 0; i < msgs.size(); i++) {
+                    if (msgs[i].op == BTREE_MSG_PUT || msgs[i].op == BTREE_MSG_INSERT) {
+                        bloom->Add(msgs[i].key);
+                        added++;
                     }
-                    return errorMessage;
                 }
             }
-            if (dummy.info.numkeys > 0) {
-                if ((errorMessage = dummy.GetPtr(dummy.info.numkeys, ptr))) return errorMessage;
-                if ((errorMessage = splitInsert(ptr, key, value))) return errorMessage;
-                 temp.Unserialize(buffercache, ptr);
-
-                 int interior =  temp.info.GetNumSlotsAsInterior();
-                    int leaf1 = temp.info.GetNumSlotsAsLeaf();
-                    // cout << "interior= " << interior<< endl;
-                    // cout << "leaf1= " << leaf1<< endl;
-                if((temp.info.nodetype == BTREE_INTERIOR_NODE && temp.info.numkeys == temp.info.GetNumSlotsAsInterior() ) || (temp.info.nodetype == BTREE_LEAF_NODE && temp.info.numkeys == temp.info.GetNumSlotsAsLeaf())) 
-                {
-                  
-                    if ((errorMessage = SplitNode(ptr, newNode, middle))) return errorMessage;
-                   return InsertOneNode(node, middle, VALUE_T(), newNode);
-                }
-                return errorMessage;
+            if (dummy.info.numkeys == 0) {
+                return ERROR_NOERROR;
             }
-            return ERROR_INSANE;
+            for (position = 0; position <= dummy.info.numkeys; position++) {
+                if ((errorMessage = dummy.GetPtr(position, ptr))) return errorMessage;
+                if ((errorMessage = BloomAddSubtree(ptr, added))) return errorMessage;
+            }
+            return ERROR_NOERROR;
         case BTREE_LEAF_NODE:
-            return InsertOneNode(node, key, value, 0);
+            for (position = 0; position < dummy.info.numkeys; position++) {
+                if ((errorMessage = dummy.GetKey(position, testkey))) return errorMessage;
+                bloom->Add(testkey);
+            }
+            added += dummy.info.numkeys;
+            return ERROR_NOERROR;
         default:
             return ERROR_INSANE;
     }
 }
 
 
-ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value) {
-    VALUE_T v = value;
-    if (Lookup(key, v) != ERROR_NONEXISTENT) {
-        return ERROR_CONFLICT;
-    }
-
+//
+// Load the filter named by the superblock, if any.  If inserts happened
+// after the bits were last written, they are stale and are rebuilt
+// from the tree instead.
+//
+ERROR_T BTreeIndex::ReadBloomFilter() {
     ERROR_T errorMessage;
-    BTreeNode dummy(BTREE_LEAF_NODE, superblock.info.keysize, superblock.info.valuesize, buffercache->GetBlockSize());
-    BTreeNode rootNode;
-    rootNode.Unserialize(buffercache, superblock.info.rootnode);
-    BTreeNode temp;
+    SuperblockExt ext;
+    BTreeNode dummy;
+    SIZE_T node;
+    SIZE_T offset;
 
+    delete bloom;
+    bloom = 0;
+    bloomblocks.clear();
 
-    //if no node exists, create a new root node, and connect it with two leaf nodes.
-    if (rootNode.info.numkeys == 0) {
-        SIZE_T leftNode, rightNode;
-        if ((errorMessage = AllocateNode(leftNode))) return errorMessage;
-        if ((errorMessage = AllocateNode(rightNode))) return errorMessage;
-        dummy.Serialize(buffercache, leftNode);
-        dummy.Serialize(buffercache, rightNode);
-        rootNode.info.numkeys = 1;
-        rootNode.SetKey(0, key);
-        rootNode.SetPtr(0, leftNode);
-        rootNode.SetPtr(1, rightNode);
-        rootNode.Serialize(buffercache, superblock.info.rootnode);
+    GetSuperblockExt(ext);
+    if (ext.bloomblock == 0) {
+        return ERROR_NOERROR;
     }
 
-    SIZE_T oldRoot, newNode;
-    KEY_T middle;
-    oldRoot = superblock.info.rootnode;
-    errorMessage = splitInsert(superblock.info.rootnode,key,value);
-     temp.Unserialize(buffercache, superblock.info.rootnode);
-
-     int interior =  temp.info.GetNumSlotsAsInterior() / 66;
-     int leaf1 = temp.info.GetNumSlotsAsLeaf() / 66;
-    if((temp.info.nodetype == BTREE_INTERIOR_NODE && temp.info.numkeys == temp.info.GetNumSlotsAsInterior() ) || (temp.info.nodetype == BTREE_LEAF_NODE && temp.info.numkeys == temp.info.GetNumSlotsAsLeaf())) 
-      { 
-        SplitNode(oldRoot, newNode, middle);
-        if ((errorMessage = AllocateNode(superblock.info.rootnode))) return errorMessage;
-        rootNode.info.numkeys = 1;
-        rootNode.SetKey(0, middle);
-        rootNode.SetPtr(0, oldRoot);
-        rootNode.SetPtr(1, newNode);
-        return rootNode.Serialize(buffercache, superblock.info.rootnode);
-       }
-    return errorMessage;
+    bloom = new BloomFilter(superblock.info.keysize, ext.bloombits, ext.bloomhashes);
+    offset = 0;
+    for (node = ext.bloomblock; node != 0; node = dummy.info.freelist) {
+        if ((errorMessage = dummy.Unserialize(buffercache, node))) return errorMessage;
+        if (dummy.info.nodetype != BTREE_BLOOM_BLOCK || offset + dummy.info.numkeys > bloom->GetNumBytes()) {
+            return ERROR_INSANE;
+        }
+        memcpy(bloom->GetBits() + offset, dummy.data, dummy.info.numkeys);
+        offset += dummy.info.numkeys;
+        bloomblocks.push_back(node);
+    }
+
+    if (!ext.bloomclean || ext.bloomstale || offset != bloom->GetNumBytes()) {
+        return RebuildBloomFilter();
+    }
+    return ERROR_NOERROR;
 }
 
 
-ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value) {
-    VALUE_T v(value);
-    return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_UPDATE, key, v);
+ERROR_T BTreeIndex::WriteBloomFilter() {
+    ERROR_T errorMessage;
+    SuperblockExt ext;
+    BTreeNode dummy(BTREE_BLOOM_BLOCK, superblock.info.keysize, superblock.info.valuesize,
+                    buffercache->GetBlockSize());
+    SIZE_T offset;
+    SIZE_T len;
+
+    offset = 0;
+    for (SIZE_T i = 0; i < bloomblocks.size(); i++) {
+        len = bloom->GetNumBytes() - offset;
+        if (len > dummy.info.GetNumDataBytes()) {
+            len = dummy.info.GetNumDataBytes();
+        }
+        dummy.info.numkeys = len;
+        dummy.info.freelist = (i + 1 == bloomblocks.size()) ? 0 : bloomblocks[i + 1];
+        memcpy(dummy.data, bloom->GetBits() + offset, len);
+        if ((errorMessage = dummy.Serialize(buffercache, bloomblocks[i]))) return errorMessage;
+        offset += len;
+    }
+
+    GetSuperblockExt(ext);
+    ext.bloomclean = 1;
+    SetSuperblockExt(ext);
+    return superblock.Serialize(buffercache, superblock_index);
 }
 
 
-ERROR_T BTreeIndex::Delete(const KEY_T &key) {
-    // This is optional extra credit
-    //
-    //
-    
-    return ERROR_UNIMPL;
+ERROR_T BTreeIndex::FreeBloomBlocks() {
+    ERROR_T errorMessage;
+
+    while (!bloomblocks.empty()) {
+        if ((errorMessage = DeallocateNode(bloomblocks.back()))) return errorMessage;
+        bloomblocks.pop_back();
+    }
+    return ERROR_NOERROR;
 }
 
 
 //
+// The on disk bits no longer cover every key, so make sure a later
+// Attach won't trust them until Detach writes them again
 //
-// DEPTH first traversal
-// DOT is Depth + DOT format
-//
+ERROR_T BTreeIndex::NoteBloomDirty() {
+    SuperblockExt ext;
 
-ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node, ostream &o, BTreeDisplayType display_type) const {
-    KEY_T testkey;
-    SIZE_T ptr;
-    BTreeNode dummy;
+    GetSuperblockExt(ext);
+    if (!ext.bloomclean) {
+        return ERROR_NOERROR;
+    }
+    ext.bloomclean = 0;
+    SetSuperblockExt(ext);
+    return superblock.Serialize(buffercache, superblock_index);
+}
+
+
+//
+// Add key to the filter, counting it toward the keys the filter holds
+//
+ERROR_T BTreeIndex::BloomAdd(const KEY_T &key) {
     ERROR_T errorMessage;
-    SIZE_T position;
+    SuperblockExt ext;
 
-    errorMessage = dummy.Unserialize(buffercache, node);
+    if ((errorMessage = NoteBloomDirty())) return errorMessage;
+    bloom->Add(key);
+    GetSuperblockExt(ext);
+    ext.bloomkeys++;
+    SetSuperblockExt(ext);
+    return ERROR_NOERROR;
+}
 
-    if (errorMessage != ERROR_NOERROR) {
-        return errorMessage;
+
+//
+// Count a key actually removed from a leaf, its bits stay set.  Once
+// enough have been counted the filter is marked stale, it is rebuilt
+// later by RebuildStaleBloomFilter rather than in the middle of a delete.
+//
+void BTreeIndex::NoteBloomDelete() {
+    SuperblockExt ext;
+
+    GetSuperblockExt(ext);
+    ext.bloomdeletes++;
+    if (ext.bloomdeletes * BTREE_BLOOM_REBUILD_RATIO > ext.bloomkeys) {
+        ext.bloomstale = 1;
     }
+    SetSuperblockExt(ext);
+}
 
-    errorMessage = PrintNode(o, node, dummy, display_type);
 
-    if (errorMessage) { return errorMessage; }
+//
+// Called by FlushBuffers and Detach, which already touch much of the tree
+//
+ERROR_T BTreeIndex::RebuildStaleBloomFilter() {
+    SuperblockExt ext;
 
-    if (display_type == BTREE_DEPTH_DOT) {
-        o << ";";
+    GetSuperblockExt(ext);
+    if (!bloom || !ext.bloomstale) {
+        return ERROR_NOERROR;
     }
+    return RebuildBloomFilter();
+}
 
-    if (display_type != BTREE_SORTED_KEYVAL) {
-        o << endl;
+
+
+static void WidenLeaf(BTreeNode &leaf, const SIZE_T blocksize) {
+    BTreeNode wide(BTREE_LEAF_NODE, leaf.info.keysize, leaf.info.valuesize, blocksize);
+    SIZE_T databytes = leaf.info.GetNumDataBytes();
+
+    wide.info = leaf.info;
+    wide.info.blocksize = blocksize;
+    memcpy(wide.data, leaf.data, databytes);
+    leaf = wide;
+}
+
+
+SIZE_T BTreeIndex::LeafBlockSize() const {
+    SuperblockExt ext;
+
+    GetSuperblockExt(ext);
+    if (ext.compressleaves) {
+        return buffercache->GetBlockSize() * BTREE_LEAF_EXPANSION;
     }
+    return buffercache->GetBlockSize();
+}
 
-    switch (dummy.info.nodetype) {
-        case BTREE_ROOT_NODE:
-        case BTREE_INTERIOR_NODE:
-            if (dummy.info.numkeys > 0) {
-                for (position = 0; position <= dummy.info.numkeys; position++) {
-                    errorMessage = dummy.GetPtr(position, ptr);
-                    if (errorMessage) { return errorMessage; }
-                    if (display_type == BTREE_DEPTH_DOT) {
-                        o << node << " -> " << ptr << ";\n";
-                    }
-                    errorMessage = DisplayInternal(ptr, o, display_type);
-                    if (errorMessage) { return errorMessage; }
-                }
-            }
-            return ERROR_NOERROR;
-            break;
-        case BTREE_LEAF_NODE:
-            return ERROR_NOERROR;
-            break;
-        default:
-            if (display_type == BTREE_DEPTH_DOT) {
-            } else {
-                o << "Unsupported Node Type " << dummy.info.nodetype;
-            }
+
+//
+// Read the node at block.  A leaf always comes back as an ordinary leaf
+// node: decoded if it is compressed, and with room to grow past what
+// fits raw if compression is on.
+//
+ERROR_T BTreeIndex::ReadNode(const SIZE_T &block, BTreeNode &node) const {
+    ERROR_T errorMessage;
+    SuperblockExt ext;
+    SIZE_T blocksize = buffercache->GetBlockSize() * BTREE_LEAF_EXPANSION;
+    SIZE_T len;
+
+    if ((errorMessage = node.Unserialize(buffercache, block))) return errorMessage;
+
+    if (node.info.nodetype == BTREE_COMPRESSED_LEAF_NODE) {
+        BTreeNode leaf(BTREE_LEAF_NODE, superblock.info.keysize, superblock.info.valuesize, blocksize);
+
+        memcpy(&len, node.data, sizeof(SIZE_T));
+        if (2 * sizeof(SIZE_T) + len > node.info.GetNumDataBytes() ||
+            node.info.numkeys > leaf.info.GetNumSlotsAsLeaf()) {
+            return ERROR_INSANE;
+        }
+        leaf.info.rootnode = node.info.rootnode;
+        leaf.info.numkeys = node.info.numkeys;
+        leaf.info.freelist = 2 * sizeof(SIZE_T) + len;
+        // the leaf's pointer, then its records
+        memcpy(leaf.data, node.data + sizeof(SIZE_T), sizeof(SIZE_T));
+        if (!leafcodec->Decode(node.data + 2 * sizeof(SIZE_T), len, leaf.info.numkeys,
+                               leaf.data + sizeof(SIZE_T))) {
             return ERROR_INSANE;
+        }
+        node = leaf;
+        return ERROR_NOERROR;
     }
 
+    if (node.info.nodetype == BTREE_LEAF_NODE) {
+        node.info.freelist = sizeof(SIZE_T) + node.info.numkeys * (node.info.keysize + node.info.valuesize);
+        GetSuperblockExt(ext);
+        if (ext.compressleaves) {
+            WidenLeaf(node, blocksize);
+        }
+    }
     return ERROR_NOERROR;
 }
 
 
-ERROR_T BTreeIndex::Display(ostream &o, BTreeDisplayType display_type) const {
+//
+// Write node to block.  A leaf is compressed if that makes it smaller
+// and compression is on, or if it has more entries than fit raw.  A
+// leaf that fits in the block neither way is not written, and we return
+// ERROR_SIZE for our caller to make room in it, see MakeRoom.
+//
+ERROR_T BTreeIndex::WriteNode(const SIZE_T &block, BTreeNode &node) {
     ERROR_T errorMessage;
-    if (display_type == BTREE_DEPTH_DOT) {
-        o << "digraph tree { \n";
+    SuperblockExt ext;
+    vector<char> encoded;
+    SIZE_T rawslots = superblock.info.GetNumSlotsAsLeaf();
+    SIZE_T recsize = superblock.info.keysize + superblock.info.valuesize;
+    SIZE_T databytes = superblock.info.GetNumDataBytes();
+    SIZE_T len, bytes;
+    BTreeNode raw(BTREE_LEAF_NODE, superblock.info.keysize, superblock.info.valuesize,
+                  buffercache->GetBlockSize());
+
+    if (node.info.nodetype != BTREE_LEAF_NODE) {
+        return node.Serialize(buffercache, block);
     }
-    errorMessage = DisplayInternal(superblock.info.rootnode, o, display_type);
-    if (display_type == BTREE_DEPTH_DOT) {
-        o << "}\n";
+    GetSuperblockExt(ext);
+    // without compression a raw sized leaf is new or came from a raw block
+    if (!ext.compressleaves && node.info.blocksize == buffercache->GetBlockSize()) {
+        node.info.freelist = sizeof(SIZE_T) + node.info.numkeys * recsize;
+        return node.Serialize(buffercache, block);
+    }
+
+    if (ext.compressleaves || node.info.numkeys > rawslots) {
+        leafcodec->Encode(node.data + sizeof(SIZE_T), node.info.numkeys, encoded);
+        len = encoded.size();
+        bytes = 2 * sizeof(SIZE_T) + len;
+        if (node.info.numkeys > rawslots && bytes > databytes) {
+            return ERROR_SIZE;
+        }
+        if (bytes <= databytes && (node.info.numkeys > rawslots || len < node.info.numkeys * recsize)) {
+            BTreeNode primary(BTREE_COMPRESSED_LEAF_NODE, superblock.info.keysize, superblock.info.valuesize,
+                              buffercache->GetBlockSize());
+
+            primary.info.rootnode = node.info.rootnode;
+            primary.info.numkeys = node.info.numkeys;
+            memcpy(primary.data, &len, sizeof(SIZE_T));
+            memcpy(primary.data + sizeof(SIZE_T), node.data, sizeof(SIZE_T));
+            if (len > 0) {
+                memcpy(primary.data + 2 * sizeof(SIZE_T), &encoded[0], len);
+            }
+            if ((errorMessage = primary.Serialize(buffercache, block))) return errorMessage;
+            leafcodec->NoteEncoded(node.info.numkeys, len);
+            node.info.freelist = bytes;
+            return ERROR_NOERROR;
+        }
     }
+
+    raw.info.rootnode = node.info.rootnode;
+    raw.info.numkeys = node.info.numkeys;
+    memcpy(raw.data, node.data, sizeof(SIZE_T) + node.info.numkeys * recsize);
+    if ((errorMessage = raw.Serialize(buffercache, block))) return errorMessage;
+    node.info.freelist = sizeof(SIZE_T) + node.info.numkeys * recsize;
     return ERROR_NOERROR;
 }
 
 
-ERROR_T BTreeIndex::SanityCheckHelper(const SIZE_T &node, const KEY_T &key, const SIZE_T &isLeft) const {
-    BTreeNode dummy;
-    SIZE_T position;
-    KEY_T preKey;
+//
+// Bytes of its block that leaf takes, written as it is now.  ReadNode
+// and WriteNode leave that in info.freelist of the leaf and
+// InsertIntoLeaf adds a record to it, so it is only worked out again,
+// by encoding the leaf the way WriteNode would, when that is 0.
+//
+SIZE_T BTreeIndex::LeafBytes(const BTreeNode &leaf) const {
+    SuperblockExt ext;
+    vector<char> encoded;
+    SIZE_T rawslots = superblock.info.GetNumSlotsAsLeaf();
+    SIZE_T recsize = superblock.info.keysize + superblock.info.valuesize;
+    SIZE_T bytes;
+
+    if (leaf.info.freelist != 0) {
+        return leaf.info.freelist;
+    }
+    GetSuperblockExt(ext);
+    if (ext.compressleaves || leaf.info.numkeys > rawslots) {
+        leafcodec->Encode(leaf.data + sizeof(SIZE_T), leaf.info.numkeys, encoded);
+        bytes = 2 * sizeof(SIZE_T) + encoded.size();
+        if (leaf.info.numkeys > rawslots ||
+            (bytes <= superblock.info.GetNumDataBytes() && encoded.size() < leaf.info.numkeys * recsize)) {
+            return bytes;
+        }
+    }
+    return sizeof(SIZE_T) + leaf.info.numkeys * recsize;
+}
+
+
+ERROR_T BTreeIndex::FindInCompressedLeaf(const BTreeNode &block, const KEY_T &key, VALUE_T &value) const {
+    SIZE_T len;
+    bool found;
+
+    memcpy(&len, block.data, sizeof(SIZE_T));
+    if (2 * sizeof(SIZE_T) + len > block.info.GetNumDataBytes()) {
+        return ERROR_INSANE;
+    }
+    value = VALUE_T(superblock.info.valuesize);
+    if (!leafcodec->Find(block.data + 2 * sizeof(SIZE_T), len, block.info.numkeys, key.data, value.data, found)) {
+        return ERROR_INSANE;
+    }
+    return found ? ERROR_NOERROR : ERROR_NONEXISTENT;
+}
+
+
+ERROR_T BTreeIndex::SetLeafCompression(const bool compress) {
+    SuperblockExt ext;
+
+    GetSuperblockExt(ext);
+    ext.compressleaves = compress ? 1 : 0;
+    SetSuperblockExt(ext);
+    return superblock.Serialize(buffercache, superblock_index);
+}
+
+
+ERROR_T BTreeIndex::GetLeafCompressionStats(LeafCompressionStats &stats) const {
+    if (!leafcodec) {
+        return ERROR_NONEXISTENT;
+    }
+    leafcodec->GetStats(stats);
+    return ERROR_NOERROR;
+}
+
+
+static char *ResolveCount(const BTreeNode &node, const SIZE_T position) {
+    return node.data + node.info.GetNumDataBytes() - (position + 1) * sizeof(SIZE_T);
+}
+
+
+static SIZE_T GetChildCount(const BTreeNode &node, const SIZE_T position) {
+    SIZE_T count;
+
+    memcpy(&count, ResolveCount(node, position), sizeof(SIZE_T));
+    return count;
+}
+
+
+static void SetChildCount(BTreeNode &node, const SIZE_T position, const SIZE_T count) {
+    memcpy(ResolveCount(node, position), &count, sizeof(SIZE_T));
+}
+
+
+//
+// What a message does to the number of keys, known when it was queued
+//
+static long MessageDelta(const BTreeMessage &msg) {
+    switch (msg.op) {
+        case BTREE_MSG_INSERT:
+            return 1;
+        case BTREE_MSG_DELETE:
+            return -1;
+        default:
+            return 0;
+    }
+}
+
+
+//
+// Keys an interior node has room for, fewer if the counts of its
+// children take up the end of it
+//
+SIZE_T BTreeIndex::InteriorSlots(const BTreeNode &node) const {
+    SuperblockExt ext;
+
+    GetSuperblockExt(ext);
+    if (!ext.counted) {
+        return node.info.GetNumSlotsAsInterior();
+    }
+    return (node.info.GetNumDataBytes() - 2 * sizeof(SIZE_T)) / (node.info.keysize + 2 * sizeof(SIZE_T));
+}
+
+
+//
+// A node is full once it holds as many keys as fit in it, a compressed
+// leaf once another entry might not fit in its block.  Nodes are split
+// or relieved as soon as they fill up, so a node that isn't full always
+// has room for one more key.
+//
+bool BTreeIndex::IsFull(const BTreeNode &node) const {
+    SuperblockExt ext;
+
+    switch (node.info.nodetype) {
+        // the root is checked like any interior node, so that RelieveRoot
+        // grows the tree when it fills up
+        case BTREE_ROOT_NODE:
+        case BTREE_INTERIOR_NODE:
+            GetSuperblockExt(ext);
+            if (ext.buffered && node.info.numkeys + 1 >= ext.maxfanout) {
+                return true;
+            }
+            return node.info.numkeys >= InteriorSlots(node);
+        case BTREE_LEAF_NODE:
+            if (node.info.numkeys >= node.info.GetNumSlotsAsLeaf()) {
+                return true;
+            }
+            GetSuperblockExt(ext);
+            if (!ext.compressleaves) {
+                return node.info.numkeys >= superblock.info.GetNumSlotsAsLeaf();
+            }
+            return LeafBytes(node) + node.info.keysize + node.info.valuesize > superblock.info.GetNumDataBytes();
+        default:
+            return false;
+    }
+}
+
+
+//
+// Number of keys the left half keeps when a full node is split.
+// While inserts keep landing on the right (left) edge of their leaf the
+// split is made at that edge, leaving the old node filled to the fill
+// factor instead of half empty.  Otherwise split down the middle.
+//
+SIZE_T BTreeIndex::SplitPoint(const BTreeNode &node) const {
+    SuperblockExt ext;
+    SIZE_T numkeys = node.info.numkeys;
+    SIZE_T minleft, maxleft, left;
+
+    GetSuperblockExt(ext);
+
+    // a leaf keeps at least one entry on each side, an interior node
+    // also gives up one key to its parent
+    minleft = 1;
+    maxleft = (node.info.nodetype == BTREE_LEAF_NODE) ? numkeys - 1 : numkeys - 2;
+
+    if (appendrun >= BTREE_EDGE_RUN) {
+        left = numkeys * ext.fillpercent / 100;
+    } else if (descendrun >= BTREE_EDGE_RUN) {
+        left = numkeys - numkeys * ext.fillpercent / 100;
+    } else if (node.info.nodetype == BTREE_LEAF_NODE) {
+        left = numkeys / 2 + 1;
+    } else {
+        left = numkeys / 2;
+    }
+
+    if (left < minleft) {
+        left = minleft;
+    }
+    if (left > maxleft) {
+        left = maxleft;
+    }
+    return left;
+}
+
+
+//
+// The first left entries of leaf in leftleaf, the rest in rightleaf
+//
+static void CutLeaf(const BTreeNode &leaf, const SIZE_T left, BTreeNode &leftleaf, BTreeNode &rightleaf) {
+    SIZE_T recsize = leaf.info.keysize + leaf.info.valuesize;
+
+    leftleaf = leaf;
+    rightleaf = leaf;
+    memcpy(rightleaf.ResolveKeyVal(0), leaf.ResolveKeyVal(left), (leaf.info.numkeys - left) * recsize);
+    leftleaf.info.numkeys = left;
+    rightleaf.info.numkeys = leaf.info.numkeys - left;
+    // neither size is known yet, see LeafBytes
+    leftleaf.info.freelist = 0;
+    rightleaf.info.freelist = 0;
+}
+
+
+ERROR_T BTreeIndex::SplitNode(const SIZE_T &node, SIZE_T &newNode, KEY_T &middle) {
+    BTreeNode leftNode, rightNode, leafnode;
+    SIZE_T leftKeyNum, rightKeyNum;
+    SIZE_T databytes = superblock.info.GetNumDataBytes();
+    char *src, *dest;
+    ERROR_T errorMessage;
+    SuperblockExt ext;
+    int step;
+
+    if ((errorMessage = ReadNode(node, leftNode))) return errorMessage;
+    rightNode = leftNode;
+    leftKeyNum = SplitPoint(leftNode);
+    if (leftNode.info.nodetype == BTREE_LEAF_NODE) {
+        // Each half has to fit in a block, which some split points of a
+        // compressed leaf may not give: move the split away from the
+        // half that doesn't, always the same way
+        leafnode = leftNode;
+        step = 0;
+        for (;;) {
+            CutLeaf(leafnode, leftKeyNum, leftNode, rightNode);
+            leftNode.info.freelist = LeafBytes(leftNode);
+            rightNode.info.freelist = LeafBytes(rightNode);
+            if (leftNode.info.freelist > databytes && step <= 0 && leftKeyNum > 1) {
+                step = -1;
+                leftKeyNum--;
+            } else if (rightNode.info.freelist > databytes && step >= 0 && leftKeyNum + 1 < leafnode.info.numkeys) {
+                step = 1;
+                leftKeyNum++;
+            } else {
+                break;
+            }
+        }
+        if (leftNode.info.freelist > databytes || rightNode.info.freelist > databytes) {
+            return ERROR_INSANE;
+        }
+        rightKeyNum = rightNode.info.numkeys;
+        leftNode.GetKey(leftKeyNum - 1, middle);                 // give split a value
+    } else {
+        // the key at leftKeyNum moves up to the parent, and every key
+        // after it, with the pointers around them, to the right half
+        rightKeyNum = leftNode.info.numkeys - leftKeyNum - 1;
+        leftNode.GetKey(leftKeyNum, middle);
+        src = leftNode.ResolvePtr(leftKeyNum + 1);
+        dest = rightNode.ResolvePtr(0);
+        memmove(dest, src, rightKeyNum * (leftNode.info.keysize + sizeof(SIZE_T)) + sizeof(SIZE_T));
+        GetSuperblockExt(ext);
+        if (ext.counted) {
+            // as do the counts of the children that move
+            memmove(ResolveCount(rightNode, rightKeyNum), ResolveCount(leftNode, leftNode.info.numkeys),
+                    (rightKeyNum + 1) * sizeof(SIZE_T));
+        }
+        // splitting the root, Insert will put a new root above both halves
+        leftNode.info.nodetype = BTREE_INTERIOR_NODE;
+        rightNode.info.nodetype = BTREE_INTERIOR_NODE;
+        leftNode.info.numkeys = leftKeyNum;
+        rightNode.info.numkeys = rightKeyNum;
+    }
+    if ((errorMessage = AllocateNode(newNode))) return errorMessage;
+
+    // pending messages follow their keys into the two halves
+    GetSuperblockExt(ext);
+    if (ext.buffered && leftNode.info.nodetype == BTREE_INTERIOR_NODE && leftNode.info.freelist != 0) {
+        vector<BTreeMessage> msgs, leftmsgs, rightmsgs;
+
+        if ((errorMessage = ReadMessages(leftNode, msgs))) return errorMessage;
+        for (SIZE_T i = 0; i < msgs.size(); i++) {
+            if (msgs[i].key < middle || msgs[i].key == middle) {
+                leftmsgs.push_back(msgs[i]);
+            } else {
+                rightmsgs.push_back(msgs[i]);
+            }
+        }
+        rightNode.info.freelist = 0;
+        if ((errorMessage = WriteMessages(leftNode, node, leftmsgs))) return errorMessage;
+        if ((errorMessage = WriteMessages(rightNode, newNode, rightmsgs))) return errorMessage;
+    }
+
+    if ((errorMessage = WriteNode(node, leftNode))) return errorMessage;
+    if ((errorMessage = WriteNode(newNode, rightNode))) return errorMessage;
+    return ERROR_NOERROR;
+}
+
+
+//
+// Lay the entries of consecutive leaves out again in the same order,
+// counts[i] of them in leaves[i]
+//
+static void SpreadLeafEntries(vector<BTreeNode> &leaves, const vector<SIZE_T> &counts) {
+    SIZE_T recsize = leaves[0].info.keysize + leaves[0].info.valuesize;
+    vector<char> entries;
+    SIZE_T blocksize;
+    SIZE_T offset;
+    char *src;
+
+    blocksize = 0;
+    for (SIZE_T i = 0; i < leaves.size(); i++) {
+        if (leaves[i].info.numkeys > 0) {
+            src = leaves[i].ResolveKeyVal(0);
+            entries.insert(entries.end(), src, src + leaves[i].info.numkeys * recsize);
+        }
+        if (leaves[i].info.blocksize > blocksize) {
+            blocksize = leaves[i].info.blocksize;
+        }
+    }
+    offset = 0;
+    for (SIZE_T i = 0; i < leaves.size(); i++) {
+        // a raw leaf may get more entries than it has room for from a
+        // decoded compressed one
+        if (counts[i] > leaves[i].info.GetNumSlotsAsLeaf()) {
+            WidenLeaf(leaves[i], blocksize);
+        }
+        leaves[i].info.numkeys = counts[i];
+        leaves[i].info.freelist = 0;
+        memcpy(leaves[i].ResolveKeyVal(0), &entries[offset], counts[i] * recsize);
+        offset += counts[i] * recsize;
+    }
+}
+
+
+//
+// Spreading by count can still leave a compressed leaf full, as some
+// entries encode larger than others
+//
+bool BTreeIndex::SpreadFits(const vector<BTreeNode> &leaves) const {
+    for (SIZE_T i = 0; i < leaves.size(); i++) {
+        if (IsFull(leaves[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+//
+// Whether sibling has enough free slots to be worth levelling a full
+// leaf with, see BTREE_REDISTRIBUTE_SLACK
+//
+bool BTreeIndex::HasSlack(const BTreeNode &sibling) const {
+    SuperblockExt ext;
+    SIZE_T slots = sibling.info.GetNumSlotsAsLeaf();
+    SIZE_T slack;
+
+    GetSuperblockExt(ext);
+    slack = slots / BTREE_REDISTRIBUTE_SLACK;
+    if (slack < slots * (100 - ext.fillpercent) / 100) {
+        slack = slots * (100 - ext.fillpercent) / 100;
+    }
+    if (slack < 1) {
+        slack = 1;
+    }
+    return sibling.info.numkeys + slack < slots;
+}
+
+
+//
+// B*-tree style relief of a full leaf: even out the entries of the leaves
+// at left and left+1 of parent, and move the separator between them.
+// moved says whether they could be evened out without either ending up
+// full; if not, nothing is written.
+//
+ERROR_T BTreeIndex::RedistributeLeaves(const SIZE_T &node, BTreeNode &parent, const SIZE_T left, bool &moved) {
+    vector<BTreeNode> leaves(2);
+    vector<SIZE_T> ptrs(2), counts(2);
+    ERROR_T errorMessage;
+    SIZE_T total;
+    KEY_T separator;
+
+    for (SIZE_T i = 0; i < 2; i++) {
+        if ((errorMessage = parent.GetPtr(left + i, ptrs[i]))) return errorMessage;
+        if ((errorMessage = ReadNode(ptrs[i], leaves[i]))) return errorMessage;
+    }
+    total = leaves[0].info.numkeys + leaves[1].info.numkeys;
+    counts[0] = (total + 1) / 2;
+    counts[1] = total - counts[0];
+    SpreadLeafEntries(leaves, counts);
+    moved = SpreadFits(leaves);
+    if (!moved) {
+        return ERROR_NOERROR;
+    }
+
+    for (SIZE_T i = 0; i < 2; i++) {
+        if ((errorMessage = WriteNode(ptrs[i], leaves[i]))) return errorMessage;
+    }
+    if ((errorMessage = leaves[0].GetKey(counts[0] - 1, separator))) return errorMessage;
+    if ((errorMessage = parent.SetKey(left, separator))) return errorMessage;
+    return parent.Serialize(buffercache, node);
+}
+
+
+//
+// B*-tree style split: the leaves at left and left+1 of parent are both
+// (nearly) full, so spread their entries over three leaves, each about
+// two thirds full, instead of splitting one of them in half.  moved
+// says whether that left none of the three full.
+//
+ERROR_T BTreeIndex::SplitLeavesTwoToThree(const SIZE_T &node, BTreeNode &parent, const SIZE_T left, bool &moved) {
+    vector<BTreeNode> leaves(2);
+    vector<SIZE_T> ptrs(3), counts(3);
+    ERROR_T errorMessage;
+    SIZE_T total;
+    KEY_T separator;
+
+    for (SIZE_T i = 0; i < 2; i++) {
+        if ((errorMessage = parent.GetPtr(left + i, ptrs[i]))) return errorMessage;
+        if ((errorMessage = ReadNode(ptrs[i], leaves[i]))) return errorMessage;
+    }
+    leaves.push_back(BTreeNode(BTREE_LEAF_NODE, superblock.info.keysize, superblock.info.valuesize,
+                               LeafBlockSize()));
+
+    total = leaves[0].info.numkeys + leaves[1].info.numkeys;
+    counts[0] = (total + 2) / 3;
+    counts[1] = (total - counts[0] + 1) / 2;
+    counts[2] = total - counts[0] - counts[1];
+    SpreadLeafEntries(leaves, counts);
+    moved = SpreadFits(leaves);
+    if (!moved) {
+        return ERROR_NOERROR;
+    }
+    if ((errorMessage = AllocateNode(ptrs[2]))) return errorMessage;
+
+    for (SIZE_T i = 0; i < 3; i++) {
+        if ((errorMessage = WriteNode(ptrs[i], leaves[i]))) return errorMessage;
+    }
+    if ((errorMessage = leaves[0].GetKey(counts[0] - 1, separator))) return errorMessage;
+    if ((errorMessage = parent.SetKey(left, separator))) return errorMessage;
+    if ((errorMessage = parent.Serialize(buffercache, node))) return errorMessage;
+    if ((errorMessage = leaves[1].GetKey(counts[1] - 1, separator))) return errorMessage;
+    return InsertOneNode(node, separator, VALUE_T(), ptrs[2]);
+}
+
+
+//
+// Called after an insert went through the child at position of node.
+// If that child filled up, make room in it, which may in turn fill
+// node up; our caller checks for that.  With force the child is split
+// even if it isn't full, see MakeRoom.
+//
+ERROR_T BTreeIndex::RelieveChild(const SIZE_T &node, const SIZE_T position, const bool force) {
+    BTreeNode parent, child, sibling;
+    ERROR_T errorMessage;
+    SuperblockExt ext;
+    SIZE_T ptr;
+    SIZE_T newNode;
+    SIZE_T left;
+    KEY_T middle;
+    bool moved;
+
+    if ((errorMessage = parent.Unserialize(buffercache, node))) return errorMessage;
+    if ((errorMessage = parent.GetPtr(position, ptr))) return errorMessage;
+    if ((errorMessage = ReadNode(ptr, child))) return errorMessage;
+    if (!force && !IsFull(child)) {
+        return ERROR_NOERROR;
+    }
+
+    // Edge splits already leave the old leaf filled to the fill factor,
+    // shifting into siblings would only undo that
+    GetSuperblockExt(ext);
+    if (!force && child.info.nodetype == BTREE_LEAF_NODE && ext.redistribute &&
+        appendrun < BTREE_EDGE_RUN && descendrun < BTREE_EDGE_RUN) {
+        // a sibling with enough room takes some of the entries, if that
+        // leaves both of them below full
+        if (position < parent.info.numkeys) {
+            if ((errorMessage = parent.GetPtr(position + 1, ptr))) return errorMessage;
+            if ((errorMessage = ReadNode(ptr, sibling))) return errorMessage;
+            if (HasSlack(sibling)) {
+                if ((errorMessage = RedistributeLeaves(node, parent, position, moved))) return errorMessage;
+                if (moved) {
+                    return RecountChildren(node, position, position + 1);
+                }
+            }
+        }
+        if (position > 0) {
+            if ((errorMessage = parent.GetPtr(position - 1, ptr))) return errorMessage;
+            if ((errorMessage = ReadNode(ptr, sibling))) return errorMessage;
+            if (HasSlack(sibling)) {
+                if ((errorMessage = RedistributeLeaves(node, parent, position - 1, moved))) return errorMessage;
+                if (moved) {
+                    return RecountChildren(node, position - 1, position);
+                }
+            }
+        }
+        // every parent has at least two children, so there is a sibling
+        left = position < parent.info.numkeys ? position : position - 1;
+        if ((errorMessage = SplitLeavesTwoToThree(node, parent, left, moved))) return errorMessage;
+        if (moved) {
+            return RecountChildren(node, left, left + 2);
+        }
+        // otherwise split the child on its own
+    }
+
+    if ((errorMessage = parent.GetPtr(position, ptr))) return errorMessage;
+    if ((errorMessage = SplitNode(ptr, newNode, middle))) return errorMessage;
+    if ((errorMessage = InsertOneNode(node, middle, VALUE_T(), newNode))) return errorMessage;
+    return RecountChildren(node, position, position + 1);
+}
+
+
+//
+// A change below the child at position of node came back with
+// ERROR_SIZE: a leaf had no room for it, and nothing was written.  Split
+// the child so that the change can be made again.  If that fills node
+// up, we return ERROR_SIZE too, for our caller to split node first;
+// the root is split by RelieveRoot.
+//
+ERROR_T BTreeIndex::MakeRoom(const SIZE_T &node, const SIZE_T position) {
+    BTreeNode parent;
+    ERROR_T errorMessage;
+
+    if ((errorMessage = RelieveChild(node, position, true))) return errorMessage;
+    if ((errorMessage = parent.Unserialize(buffercache, node))) return errorMessage;
+    return IsFull(parent) ? ERROR_SIZE : ERROR_NOERROR;
+}
+
+//
+ERROR_T BTreeIndex::InsertOneNode(const SIZE_T node, const KEY_T &key, const VALUE_T &value, const SIZE_T &newNode) {
+    BTreeNode dummy;
+    SuperblockExt ext;
+    KEY_T testkey;
+    SIZE_T numkeys;
+    SIZE_T position;
+    ERROR_T errorMessage;
+    SIZE_T recsize;
+
+    if ((errorMessage = ReadNode(node, dummy))) return errorMessage;
+
+    if (dummy.info.nodetype == BTREE_LEAF_NODE) {
+        if ((errorMessage = InsertIntoLeaf(dummy, key, value))) return errorMessage;
+        return WriteNode(node, dummy);
+    }
+
+    numkeys = dummy.info.numkeys;
+    for (position = 0; position < numkeys; position++) {
+        if ((errorMessage = dummy.GetKey(position, testkey))) return errorMessage;
+        if (key < testkey) {
+            break;
+        }
+    }
+
+    dummy.info.numkeys++;
+
+    // each key moves up together with the pointer to its right; an
+    // interior node has no values, so the leaf accessors don't apply
+    recsize = dummy.info.keysize + sizeof(SIZE_T);
+    if (position < numkeys) {
+        memmove(dummy.ResolveKey(position + 1), dummy.ResolveKey(position), (numkeys - position) * recsize);
+    }
+    if ((errorMessage = dummy.SetKey(position, key))) return errorMessage;
+    if ((errorMessage = dummy.SetPtr(position + 1, newNode))) return errorMessage;
+    GetSuperblockExt(ext);
+    if (ext.counted) {
+        // the counts move too, our caller recounts the two children
+        if (position < numkeys) {
+            memmove(ResolveCount(dummy, numkeys + 1), ResolveCount(dummy, numkeys),
+                    (numkeys - position) * sizeof(SIZE_T));
+        }
+        SetChildCount(dummy, position + 1, 0);
+    }
+    return WriteNode(node, dummy);
+}
+
+
+//
+// Put key and value in order into a leaf read with ReadNode, the caller
+// writes it back
+//
+ERROR_T BTreeIndex::InsertIntoLeaf(BTreeNode &dummy, const KEY_T &key, const VALUE_T &value) {
+    KEY_T testkey;
+    SIZE_T numkeys = dummy.info.numkeys;
+    SIZE_T position;
+    ERROR_T errorMessage;
+    SIZE_T recsize;
+
+    for (position = 0; position < numkeys; position++) {
+        if ((errorMessage = dummy.GetKey(position, testkey))) return errorMessage;
+        if (key < testkey) {
+            break;
+        }
+    }
+
+    // With compression turned off, a leaf that was compressed can be
+    // split into halves that are still full, so the leaf may have no
+    // room left.  It is then written compressed until relieved again.
+    if (numkeys >= dummy.info.GetNumSlotsAsLeaf()) {
+        WidenLeaf(dummy, buffercache->GetBlockSize() * BTREE_LEAF_EXPANSION);
+    }
+    dummy.info.numkeys++;
+
+    // keep track of runs of inserts at the edges of leaves for SplitPoint
+    appendrun = (position == numkeys) ? appendrun + 1 : 0;
+    descendrun = (position == 0 && numkeys > 0) ? descendrun + 1 : 0;
+
+    recsize = dummy.info.keysize + dummy.info.valuesize;
+    if (position < numkeys) {
+        memmove(dummy.ResolveKeyVal(position + 1), dummy.ResolveKeyVal(position), (numkeys - position) * recsize);
+    }
+    if ((errorMessage = dummy.SetKey(position, key))) return errorMessage;
+    // only an estimate of its size from here on, see LeafBytes
+    if (dummy.info.freelist != 0) {
+        dummy.info.freelist += recsize;
+    }
+    return dummy.SetVal(position, value);
+}
+
+
+//
+// Insert key into the subtree under node, or if it is already there
+// overwrite its value, or merge value into it if merge is given.
+// inserted says which happened.  If a leaf has no room for key, room
+// is made and the insert tried again, see MakeRoom.
+//
+ERROR_T BTreeIndex::splitInsert(const SIZE_T &node, const KEY_T &key, const VALUE_T &value, BTreeMergeFn merge,
+                                bool &inserted) {
+
+    BTreeNode dummy;
+    ERROR_T errorMessage;
+    SIZE_T position;
+    SIZE_T ptr;
+
+    if ((errorMessage = dummy.Unserialize(buffercache, node))) return errorMessage;
+    switch (dummy.info.nodetype) {
+        case BTREE_ROOT_NODE:
+        case BTREE_INTERIOR_NODE:
+            if (dummy.info.numkeys == 0) {
+                return ERROR_INSANE;
+            }
+            for (;;) {
+                if ((errorMessage = ChildPosition(dummy, key, position))) return errorMessage;
+                if ((errorMessage = dummy.GetPtr(position, ptr))) return errorMessage;
+                errorMessage = splitInsert(ptr, key, value, merge, inserted);
+                if (errorMessage != ERROR_SIZE) {
+                    break;
+                }
+                if ((errorMessage = MakeRoom(node, position))) return errorMessage;
+                if ((errorMessage = dummy.Unserialize(buffercache, node))) return errorMessage;
+            }
+            if (errorMessage) return errorMessage;
+            if (inserted && (errorMessage = AdjustChildCount(node, position, 1))) return errorMessage;
+            return RelieveChild(node, position);
+        case BTREE_LEAF_NODE:
+        case BTREE_COMPRESSED_LEAF_NODE:
+            return UpsertLeaf(node, key, value, merge, inserted);
+        default:
+            return ERROR_INSANE;
+    }
+}
+
+
+ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value) {
+    VALUE_T v = value;
+    if (Lookup(key, v) != ERROR_NONEXISTENT) {
+        return ERROR_CONFLICT;
+    }
+
+    ERROR_T errorMessage;
+    SuperblockExt ext;
+    bool inserted;
+
+    // The key was absent, so a cached entry can only be left over from
+    // an earlier failed operation, but never serve it
+    if (readcache) {
+        readcache->Invalidate(key);
+    }
+    if (bloom && (errorMessage = BloomAdd(key))) return errorMessage;
+
+    GetSuperblockExt(ext);
+    if (ext.buffered) {
+        return EnqueueMessage(BTreeMessage(BTREE_MSG_INSERT, key, value));
+    }
+    return InsertInternal(key, value, 0, inserted);
+}
+
+
+//
+// Upsert or merge straight into the leaves, see splitInsert
+//
+ERROR_T BTreeIndex::InsertInternal(const KEY_T &key, const VALUE_T &value, BTreeMergeFn merge, bool &inserted) {
+    ERROR_T errorMessage;
+    BTreeNode dummy(BTREE_LEAF_NODE, superblock.info.keysize, superblock.info.valuesize, LeafBlockSize());
+    BTreeNode rootNode;
+    if ((errorMessage = rootNode.Unserialize(buffercache, superblock.info.rootnode))) return errorMessage;
+
+
+    //if no node exists, create a new root node, and connect it with two leaf nodes.
+    if (rootNode.info.numkeys == 0) {
+        SIZE_T leftNode, rightNode;
+        if ((errorMessage = AllocateNode(leftNode))) return errorMessage;
+        if ((errorMessage = AllocateNode(rightNode))) return errorMessage;
+        WriteNode(leftNode, dummy);
+        WriteNode(rightNode, dummy);
+        rootNode.info.numkeys = 1;
+        rootNode.SetKey(0, key);
+        rootNode.SetPtr(0, leftNode);
+        rootNode.SetPtr(1, rightNode);
+        rootNode.Serialize(buffercache, superblock.info.rootnode);
+    }
+
+    // the root has no room for what making room below needs, split it
+    while ((errorMessage = splitInsert(superblock.info.rootnode, key, value, merge, inserted)) == ERROR_SIZE) {
+        if ((errorMessage = RelieveRoot())) return errorMessage;
+    }
+    if (errorMessage) return errorMessage;
+    return RelieveRoot();
+}
+
+
+ERROR_T BTreeIndex::UpsertLeaf(const SIZE_T &leaf, const KEY_T &key, const VALUE_T &value, BTreeMergeFn merge,
+                               bool &inserted) {
+    BTreeNode dummy;
+    ERROR_T errorMessage;
+    SuperblockExt ext;
+    SIZE_T position;
+    KEY_T testkey;
+
+    GetSuperblockExt(ext);
+    if ((errorMessage = ReadNode(leaf, dummy))) return errorMessage;
+    for (position = 0; position < dummy.info.numkeys; position++) {
+        if ((errorMessage = dummy.GetKey(position, testkey))) return errorMessage;
+        if (testkey == key) {
+            break;
+        }
+    }
+
+    inserted = (position == dummy.info.numkeys);
+    if (inserted) {
+        VALUE_T v(value);
+        if (merge) {
+            merge(0, value.data, v.data, dummy.info.valuesize);
+        }
+        if ((errorMessage = InsertIntoLeaf(dummy, key, v))) return errorMessage;
+        if ((errorMessage = WriteNode(leaf, dummy))) return errorMessage;
+        if (ext.counted) {
+            superblock.info.numkeys++;
+        }
+        return ERROR_NOERROR;
+    }
+    if (merge) {
+        merge(dummy.ResolveVal(position), value.data, dummy.ResolveVal(position), dummy.info.valuesize);
+    } else {
+        if ((errorMessage = dummy.SetVal(position, value))) return errorMessage;
+    }
+    return WriteNode(leaf, dummy);
+}
+
+
+ERROR_T BTreeIndex::Upsert(const KEY_T &key, const VALUE_T &value) {
+    ERROR_T errorMessage;
+    SuperblockExt ext;
+    SIZE_T op;
+    bool inserted;
+    VALUE_T v;
+
+    // a put message already means insert or overwrite, but the counts
+    // need to know which, so look before the filter takes the key in
+    GetSuperblockExt(ext);
+    op = BTREE_MSG_PUT;
+    if (ext.buffered && ext.counted) {
+        errorMessage = Lookup(key, v);
+        if (errorMessage && errorMessage != ERROR_NONEXISTENT) return errorMessage;
+        if (errorMessage) {
+            op = BTREE_MSG_INSERT;
+        }
+    }
+
+    if (bloom && (errorMessage = BloomAdd(key))) return errorMessage;
+
+    if (ext.buffered) {
+        errorMessage = EnqueueMessage(BTreeMessage(op, key, value));
+    } else {
+        errorMessage = InsertInternal(key, value, 0, inserted);
+    }
+    // as in Update, only serve the new value once the tree holds it
+    if (readcache) {
+        if (errorMessage == ERROR_NOERROR) {
+            readcache->Refresh(key, value);
+        } else {
+            readcache->Invalidate(key);
+        }
+    }
+    return errorMessage;
+}
+
+
+ERROR_T BTreeIndex::Merge(const KEY_T &key, const VALUE_T &operand, BTreeMergeFn merge) {
+    ERROR_T errorMessage;
+    SuperblockExt ext;
+    bool inserted;
+    VALUE_T v;
+
+    GetSuperblockExt(ext);
+    if (ext.buffered) {
+        // merge functions can't be stored in a buffer, so resolve the
+        // current value now and buffer the result
+        errorMessage = Lookup(key, v);
+        if (errorMessage && errorMessage != ERROR_NONEXISTENT) return errorMessage;
+        VALUE_T result(operand);
+        merge(errorMessage ? 0 : v.data, operand.data, result.data, superblock.info.valuesize);
+        BTreeMessage msg(errorMessage ? BTREE_MSG_INSERT : BTREE_MSG_PUT, key, result);
+
+        if (bloom && (errorMessage = BloomAdd(key))) return errorMessage;
+        if (readcache) {
+            readcache->Invalidate(key);
+        }
+        return EnqueueMessage(msg);
+    }
+
+    if (bloom && (errorMessage = BloomAdd(key))) return errorMessage;
+    if (readcache) {
+        readcache->Invalidate(key);
+    }
+    return InsertInternal(key, operand, merge, inserted);
+}
+
+
+void BTreeMergeAdd(const char *existing, const char *operand, char *result, const SIZE_T valuesize) {
+    unsigned sum;
+    unsigned carry = 0;
+
+    for (SIZE_T i = 0; i < valuesize; i++) {
+        sum = (unsigned char) operand[i] + (existing ? (unsigned char) existing[i] : 0) + carry;
+        result[i] = (char) (sum & 0xff);
+        carry = sum >> 8;
+    }
+}
+
+
+void BTreeMergeMax(const char *existing, const char *operand, char *result, const SIZE_T valuesize) {
+    const char *larger = operand;
+
+    if (existing) {
+        // compare from the most significant byte down
+        for (SIZE_T i = valuesize; i > 0; i--) {
+            if (existing[i - 1] != operand[i - 1]) {
+                larger = ((unsigned char) existing[i - 1] > (unsigned char) operand[i - 1]) ? existing : operand;
+                break;
+            }
+        }
+    }
+    memmove(result, larger, valuesize);
+}
+
+
+//
+// If the root filled up, split it and grow the tree by a level.
+// SplitNode turns the old root into an interior node, the new root
+// above both halves gets a fresh block and the superblock points to it.
+//
+ERROR_T BTreeIndex::RelieveRoot() {
+    ERROR_T errorMessage;
+    BTreeNode temp;
+    BTreeNode rootNode(BTREE_ROOT_NODE, superblock.info.keysize, superblock.info.valuesize,
+                       buffercache->GetBlockSize());
+    SIZE_T oldRoot, newNode, newRoot;
+    KEY_T middle;
+
+    oldRoot = superblock.info.rootnode;
+    if ((errorMessage = temp.Unserialize(buffercache, oldRoot))) return errorMessage;
+    if (!IsFull(temp)) {
+        return ERROR_NOERROR;
+    }
+
+    if ((errorMessage = SplitNode(oldRoot, newNode, middle))) return errorMessage;
+    if ((errorMessage = AllocateNode(newRoot))) return errorMessage;
+    rootNode.info.numkeys = 1;
+    rootNode.info.freelist = 0;
+    rootNode.SetKey(0, middle);
+    rootNode.SetPtr(0, oldRoot);
+    rootNode.SetPtr(1, newNode);
+    if ((errorMessage = rootNode.Serialize(buffercache, newRoot))) return errorMessage;
+    if ((errorMessage = RecountChildren(newRoot, 0, 1))) return errorMessage;
+    superblock.info.rootnode = newRoot;
+    return superblock.Serialize(buffercache, superblock_index);
+}
+
+
+ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value) {
+    ERROR_T errorMessage;
+    SuperblockExt ext;
+
+    GetSuperblockExt(ext);
+    if (ext.buffered) {
+        // blind, we don't know yet whether the key exists
+        errorMessage = EnqueueMessage(BTreeMessage(BTREE_MSG_UPDATE, key, value));
+        if (readcache) {
+            readcache->Invalidate(key);
+        }
+        return errorMessage;
+    }
+    errorMessage = ApplyMessage(BTreeMessage(BTREE_MSG_UPDATE, key, value));
+    if (readcache) {
+        if (errorMessage == ERROR_NOERROR) {
+            readcache->Refresh(key, value);
+        } else {
+            readcache->Invalidate(key);
+        }
+    }
+    return errorMessage;
+}
+
+
+ERROR_T BTreeIndex::Delete(const KEY_T &key) {
+    ERROR_T errorMessage;
+    SuperblockExt ext;
+    VALUE_T v(superblock.info.valuesize);
+
+    GetSuperblockExt(ext);
+    if (ext.buffered) {
+        // blind, a delete of an absent key does nothing when applied.
+        // With counts to keep it has to be known to remove a key, so
+        // one of an absent key isn't queued at all.
+        errorMessage = ext.counted ? Lookup(key, v) : ERROR_NOERROR;
+        if (errorMessage == ERROR_NOERROR) {
+            memset(v.data, 0, superblock.info.valuesize);
+            errorMessage = EnqueueMessage(BTreeMessage(BTREE_MSG_DELETE, key, v));
+        } else if (errorMessage == ERROR_NONEXISTENT) {
+            errorMessage = ERROR_NOERROR;
+        }
+    } else {
+        errorMessage = ApplyMessage(BTreeMessage(BTREE_MSG_DELETE, key, v));
+    }
+    if (readcache) {
+        readcache->Invalidate(key);
+    }
+    return errorMessage;
+}
+
+
+ERROR_T BTreeIndex::DeleteInternal(const SIZE_T &node, const KEY_T &key) {
+    BTreeNode dummy;
+    ERROR_T errorMessage;
+    SuperblockExt ext;
+    SIZE_T position;
+    SIZE_T ptr;
+
+    if ((errorMessage = dummy.Unserialize(buffercache, node))) return errorMessage;
+
+    switch (dummy.info.nodetype) {
+        case BTREE_ROOT_NODE:
+        case BTREE_INTERIOR_NODE:
+            if (dummy.info.numkeys == 0) {
+                return ERROR_NONEXISTENT;
+            }
+            // see MakeRoom, a delete can make an encoding longer
+            for (;;) {
+                if ((errorMessage = ChildPosition(dummy, key, position))) return errorMessage;
+                if ((errorMessage = dummy.GetPtr(position, ptr))) return errorMessage;
+                errorMessage = DeleteInternal(ptr, key);
+                if (errorMessage != ERROR_SIZE) {
+                    break;
+                }
+                if ((errorMessage = MakeRoom(node, position))) return errorMessage;
+                if ((errorMessage = dummy.Unserialize(buffercache, node))) return errorMessage;
+            }
+            if (errorMessage) return errorMessage;
+            return AdjustChildCount(node, position, -1);
+        case BTREE_LEAF_NODE:
+        case BTREE_COMPRESSED_LEAF_NODE:
+            if ((errorMessage = ApplyMessageToLeaf(node, BTreeMessage(BTREE_MSG_DELETE, key, VALUE_T())))) {
+                return errorMessage;
+            }
+            GetSuperblockExt(ext);
+            if (ext.counted) {
+                superblock.info.numkeys--;
+            }
+            return ERROR_NOERROR;
+        default:
+            return ERROR_INSANE;
+    }
+}
+
+
+//
+// The child of an interior node to descend into for key: the one left of
+// the first key that is not smaller, or the last one
+//
+ERROR_T BTreeIndex::ChildPosition(const BTreeNode &node, const KEY_T &key, SIZE_T &position) const {
+    ERROR_T errorMessage;
+    KEY_T testkey;
+
+    for (position = 0; position < node.info.numkeys; position++) {
+        if ((errorMessage = node.GetKey(position, testkey))) return errorMessage;
+        if (key < testkey || key == testkey) {
+            break;
+        }
+    }
+    return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::SubtreeCount(const SIZE_T &node, SIZE_T &count) const {
+    BTreeNode dummy;
+    ERROR_T errorMessage;
+
+    if ((errorMessage = dummy.Unserialize(buffercache, node))) return errorMessage;
+    count = 0;
+    switch (dummy.info.nodetype) {
+        case BTREE_ROOT_NODE:
+        case BTREE_INTERIOR_NODE:
+            if (dummy.info.numkeys == 0) {
+                return ERROR_NOERROR;
+            }
+            for (SIZE_T position = 0; position <= dummy.info.numkeys; position++) {
+                count += GetChildCount(dummy, position);
+            }
+            return ERROR_NOERROR;
+        case BTREE_LEAF_NODE:
+        case BTREE_COMPRESSED_LEAF_NODE:
+            count = dummy.info.numkeys;
+            return ERROR_NOERROR;
+        default:
+            return ERROR_INSANE;
+    }
+}
+
+
+//
+// Recompute the counts of the children of node at first..last from the
+// children themselves, after entries moved between them.  The messages
+// in node's own buffer are added back in, so it has to hold just the
+// ones still pending.
+//
+ERROR_T BTreeIndex::RecountChildren(const SIZE_T &node, const SIZE_T first, const SIZE_T last) {
+    BTreeNode dummy;
+    ERROR_T errorMessage;
+    SuperblockExt ext;
+    vector<BTreeMessage> msgs;
+    SIZE_T position;
+    SIZE_T ptr;
+    SIZE_T count;
+
+    GetSuperblockExt(ext);
+    if (!ext.counted) {
+        return ERROR_NOERROR;
+    }
+    if ((errorMessage = dummy.Unserialize(buffercache, node))) return errorMessage;
+    for (position = first; position <= last && position <= dummy.info.numkeys; position++) {
+        if ((errorMessage = dummy.GetPtr(position, ptr))) return errorMessage;
+        if ((errorMessage = SubtreeCount(ptr, count))) return errorMessage;
+        SetChildCount(dummy, position, count);
+    }
+    if (ext.buffered && (errorMessage = ReadMessages(dummy, msgs))) return errorMessage;
+    for (SIZE_T i = 0; i < msgs.size(); i++) {
+        if ((errorMessage = ChildPosition(dummy, msgs[i].key, position))) return errorMessage;
+        if (position >= first && position <= last) {
+            SetChildCount(dummy, position, GetChildCount(dummy, position) + MessageDelta(msgs[i]));
+        }
+    }
+    return dummy.Serialize(buffercache, node);
+}
+
+
+ERROR_T BTreeIndex::AdjustChildCount(const SIZE_T &node, const SIZE_T position, const int delta) {
+    BTreeNode dummy;
+    ERROR_T errorMessage;
+    SuperblockExt ext;
+
+    GetSuperblockExt(ext);
+    if (!ext.counted) {
+        return ERROR_NOERROR;
+    }
+    if ((errorMessage = dummy.Unserialize(buffercache, node))) return errorMessage;
+    SetChildCount(dummy, position, GetChildCount(dummy, position) + delta);
+    return dummy.Serialize(buffercache, node);
+}
+
+
+SIZE_T BTreeIndex::MessageCapacity() const {
+    return superblock.info.GetNumDataBytes() / (1 + superblock.info.keysize + superblock.info.valuesize);
+}
+
+
+ERROR_T BTreeIndex::ReadMessages(const BTreeNode &node, vector<BTreeMessage> &msgs) const {
+    ERROR_T errorMessage;
+    BTreeNode buffer;
+    SIZE_T recsize = 1 + superblock.info.keysize + superblock.info.valuesize;
+    KEY_T key(superblock.info.keysize);
+    VALUE_T value(superblock.info.valuesize);
+    char *rec;
+
+    msgs.clear();
+    if (node.info.freelist == 0) {
+        return ERROR_NOERROR;
+    }
+    if ((errorMessage = buffer.Unserialize(buffercache, node.info.freelist))) return errorMessage;
+    if (buffer.info.nodetype != BTREE_MESSAGE_BLOCK) {
+        return ERROR_INSANE;
+    }
+    for (SIZE_T i = 0; i < buffer.info.numkeys; i++) {
+        rec = buffer.data + i * recsize;
+        memcpy(key.data, rec + 1, superblock.info.keysize);
+        memcpy(value.data, rec + 1 + superblock.info.keysize, superblock.info.valuesize);
+        msgs.push_back(BTreeMessage((unsigned char) rec[0], key, value));
+    }
+    return ERROR_NOERROR;
+}
+
+
+//
+// Replace the pending messages of node, giving it a buffer block first
+// if it needs one
+//
+ERROR_T BTreeIndex::WriteMessages(BTreeNode &node, const SIZE_T &nodeblock, const vector<BTreeMessage> &msgs) {
+    ERROR_T errorMessage;
+    BTreeNode buffer(BTREE_MESSAGE_BLOCK, superblock.info.keysize, superblock.info.valuesize,
+                     buffercache->GetBlockSize());
+    SIZE_T recsize = 1 + superblock.info.keysize + superblock.info.valuesize;
+    SIZE_T block;
+    char *rec;
+
+    if (msgs.size() > MessageCapacity()) {
+        return ERROR_SIZE;
+    }
+    if (node.info.freelist == 0) {
+        if (msgs.empty()) {
+            return ERROR_NOERROR;
+        }
+        if ((errorMessage = AllocateNode(block))) return errorMessage;
+        node.info.freelist = block;
+        if ((errorMessage = node.Serialize(buffercache, nodeblock))) return errorMessage;
+    }
+    buffer.info.numkeys = msgs.size();
+    for (SIZE_T i = 0; i < msgs.size(); i++) {
+        rec = buffer.data + i * recsize;
+        rec[0] = (char) msgs[i].op;
+        memcpy(rec + 1, msgs[i].key.data, superblock.info.keysize);
+        memcpy(rec + 1 + superblock.info.keysize, msgs[i].value.data, superblock.info.valuesize);
+    }
+    return buffer.Serialize(buffercache, node.info.freelist);
+}
+
+
+//
+// Look for the newest pending message for key in the buffer of node.
+// found says whether there was one; if it is a delete, the key is gone.
+// Updates don't say whether the key exists, so past them the search
+// goes on for an older message.  If none is found, updated says the
+// newest update's value is in value and holds if the key exists below.
+//
+ERROR_T BTreeIndex::SearchMessages(const BTreeNode &node, const KEY_T &key, VALUE_T &value, bool &found,
+                                   bool &updated) const {
+    ERROR_T errorMessage;
+    SuperblockExt ext;
+    BTreeNode buffer;
+    SIZE_T recsize = 1 + superblock.info.keysize + superblock.info.valuesize;
+    char *rec;
+
+    found = false;
+    updated = false;
+    GetSuperblockExt(ext);
+    if (!ext.buffered || node.info.freelist == 0) {
+        return ERROR_NOERROR;
+    }
+    // this is on the path of every lookup, so scan the records in place
+    // rather than decoding them all
+    if ((errorMessage = buffer.Unserialize(buffercache, node.info.freelist))) return errorMessage;
+    for (SIZE_T i = buffer.info.numkeys; i > 0; i--) {
+        rec = buffer.data + (i - 1) * recsize;
+        if (memcmp(rec + 1, key.data, superblock.info.keysize) != 0) {
+            continue;
+        }
+        if (rec[0] == BTREE_MSG_DELETE) {
+            found = true;
+            return ERROR_NONEXISTENT;
+        }
+        if (!updated) {
+            value = VALUE_T(superblock.info.valuesize);
+            memcpy(value.data, rec + 1 + superblock.info.keysize, superblock.info.valuesize);
+        }
+        if (rec[0] == BTREE_MSG_UPDATE) {
+            updated = true;
+            continue;
+        }
+        found = true;
+        return ERROR_NOERROR;
+    }
+    return ERROR_NOERROR;
+}
+
+
+//
+// Append those of msgs headed for the child at position of node to
+// routed, keeping their order
+//
+ERROR_T BTreeIndex::RouteMessages(const BTreeNode &node, const vector<BTreeMessage> &msgs, const SIZE_T position,
+                                  vector<BTreeMessage> &routed) const {
+    ERROR_T errorMessage;
+    SIZE_T msgposition;
+
+    for (SIZE_T i = 0; i < msgs.size(); i++) {
+        if ((errorMessage = ChildPosition(node, msgs[i].key, msgposition))) return errorMessage;
+        if (msgposition == position) {
+            routed.push_back(msgs[i]);
+        }
+    }
+    return ERROR_NOERROR;
+}
+
+
+//
+// The entries of leaf as they will be once the pending messages headed
+// for it, oldest first, are applied.  Nothing is written.
+//
+static ERROR_T MergedLeafEntries(const BTreeNode &leaf, const vector<BTreeMessage> &pending,
+                                 vector<KeyValuePair> &entries) {
+    ERROR_T errorMessage;
+    KeyValuePair entry;
+    SIZE_T lo, hi, mid;
+    bool present;
+
+    entries.clear();
+    for (SIZE_T position = 0; position < leaf.info.numkeys; position++) {
+        if ((errorMessage = leaf.GetKeyVal(position, entry))) return errorMessage;
+        entries.push_back(entry);
+    }
+    for (SIZE_T i = 0; i < pending.size(); i++) {
+        // first entry not smaller than the key
+        lo = 0;
+        hi = entries.size();
+        while (lo < hi) {
+            mid = (lo + hi) / 2;
+            if (entries[mid].key < pending[i].key) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        present = lo < entries.size() && entries[lo].key == pending[i].key;
+        switch (pending[i].op) {
+            case BTREE_MSG_DELETE:
+                if (present) {
+                    entries.erase(entries.begin() + lo);
+                }
+                break;
+            case BTREE_MSG_UPDATE:
+                if (present) {
+                    entries[lo].value = pending[i].value;
+                }
+                break;
+            default:
+                if (present) {
+                    entries[lo].value = pending[i].value;
+                } else {
+                    entries.insert(entries.begin() + lo, KeyValuePair(pending[i].key, pending[i].value));
+                }
+        }
+    }
+    return ERROR_NOERROR;
+}
+
+
+//
+// Apply a message directly to the leaves, bypassing the buffers
+//
+ERROR_T BTreeIndex::ApplyMessage(const BTreeMessage &msg) {
+    ERROR_T errorMessage;
+    VALUE_T value(msg.value);
+    bool inserted;
+
+    if (msg.op != BTREE_MSG_DELETE && msg.op != BTREE_MSG_UPDATE) {
+        return InsertInternal(msg.key, msg.value, 0, inserted);
+    }
+    // as in InsertInternal, the root may need splitting to make room
+    for (;;) {
+        if (msg.op == BTREE_MSG_DELETE) {
+            errorMessage = DeleteInternal(superblock.info.rootnode, msg.key);
+        } else {
+            errorMessage = LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_UPDATE, msg.key, value);
+        }
+        if (errorMessage != ERROR_SIZE) {
+            return errorMessage;
+        }
+        if ((errorMessage = RelieveRoot())) return errorMessage;
+    }
+}
+
+
+ERROR_T BTreeIndex::ApplyMessageToLeaf(const SIZE_T &leaf, const BTreeMessage &msg) {
+    BTreeNode dummy;
+    ERROR_T errorMessage;
+
+    if ((errorMessage = ReadNode(leaf, dummy))) return errorMessage;
+    if ((errorMessage = ApplyMessageInLeaf(dummy, msg))) return errorMessage;
+    return WriteNode(leaf, dummy);
+}
+
+
+//
+// A put overwrites or inserts, an update only overwrites, a delete
+// removes the entry and shifts the rest down.  The leaf is one read with
+// ReadNode, the caller writes it back and keeps the counts.  It may
+// fill up, the caller relieves it.
+//
+ERROR_T BTreeIndex::ApplyMessageInLeaf(BTreeNode &dummy, const BTreeMessage &msg) {
+    ERROR_T errorMessage;
+    SIZE_T position;
+    KEY_T testkey;
+    SIZE_T recsize;
+
+    for (position = 0; position < dummy.info.numkeys; position++) {
+        if ((errorMessage = dummy.GetKey(position, testkey))) return errorMessage;
+        if (testkey == msg.key) {
+            break;
+        }
+    }
+
+    if (position == dummy.info.numkeys) {
+        if (msg.op != BTREE_MSG_PUT && msg.op != BTREE_MSG_INSERT) {
+            return ERROR_NONEXISTENT;
+        }
+        return InsertIntoLeaf(dummy, msg.key, msg.value);
+    }
+    if (msg.op != BTREE_MSG_DELETE) {
+        return dummy.SetVal(position, msg.value);
+    }
+    recsize = dummy.info.keysize + dummy.info.valuesize;
+    if (position + 1 < dummy.info.numkeys) {
+        memmove(dummy.ResolveKeyVal(position), dummy.ResolveKeyVal(position + 1),
+                (dummy.info.numkeys - position - 1) * recsize);
+    }
+    dummy.info.numkeys--;
+    if (bloom) {
+        NoteBloomDelete();
+    }
+    return ERROR_NOERROR;
+}
+
+
+//
+// Move one batch of messages out of the buffer of node: those headed for
+// the child with the most of them.  Into a leaf they are applied in one
+// read and write of it, relieving the leaf whenever it fills, until node
+// itself fills up.  Into
+// an interior child they are appended to its buffer, after flushing that
+// first if it is full.  node may be full afterwards, our caller relieves
+// it.
+//
+ERROR_T BTreeIndex::FlushNode(const SIZE_T &node) {
+    BTreeNode parent, child;
+    ERROR_T errorMessage;
+    SuperblockExt ext;
+    vector<BTreeMessage> msgs, childmsgs, rest, later, applied;
+    vector<SIZE_T> route, counts;
+    SIZE_T best, position, ptr, room;
+    bool recount = false;
+
+    if ((errorMessage = parent.Unserialize(buffercache, node))) return errorMessage;
+    if ((errorMessage = ReadMessages(parent, msgs))) return errorMessage;
+    if (msgs.empty()) {
+        return ERROR_NOERROR;
+    }
+    GetSuperblockExt(ext);
+
+    counts.assign(parent.info.numkeys + 1, 0);
+    for (SIZE_T i = 0; i < msgs.size(); i++) {
+        if ((errorMessage = ChildPosition(parent, msgs[i].key, position))) return errorMessage;
+        route.push_back(position);
+        counts[position]++;
+    }
+    best = 0;
+    for (position = 1; position < counts.size(); position++) {
+        if (counts[position] > counts[best]) {
+            best = position;
+        }
+    }
+    if ((errorMessage = parent.GetPtr(best, ptr))) return errorMessage;
+    if ((errorMessage = child.Unserialize(buffercache, ptr))) return errorMessage;
+
+    if (child.info.nodetype == BTREE_LEAF_NODE || child.info.nodetype == BTREE_COMPRESSED_LEAF_NODE) {
+        for (SIZE_T i = 0; i < msgs.size(); i++) {
+            if (route[i] == best) {
+                childmsgs.push_back(msgs[i]);
+            } else {
+                rest.push_back(msgs[i]);
+            }
+        }
+        while (!childmsgs.empty() && !IsFull(parent)) {
+            // splits may have moved keys to new neighbours of the leaf,
+            // so take the leaf of the oldest message and all that go there
+            // with it, up to when it fills
+            if ((errorMessage = ChildPosition(parent, childmsgs[0].key, best))) return errorMessage;
+            if ((errorMessage = parent.GetPtr(best, ptr))) return errorMessage;
+            if ((errorMessage = ReadNode(ptr, child))) return errorMessage;
+            applied.clear();
+            later.clear();
+            for (SIZE_T i = 0; i < childmsgs.size(); i++) {
+                if ((errorMessage = ChildPosition(parent, childmsgs[i].key, position))) return errorMessage;
+                // once the leaf is full the rest wait, keeping their order.
+                // Its size is only estimated after an insert, so measure
+                // it before taking it for full.
+                if (position == best && !applied.empty() && IsFull(child) && ext.compressleaves) {
+                    child.info.freelist = 0;
+                    child.info.freelist = LeafBytes(child);
+                }
+                if (position != best || (!applied.empty() && IsFull(child))) {
+                    later.push_back(childmsgs[i]);
+                    continue;
+                }
+                errorMessage = ApplyMessageInLeaf(child, childmsgs[i]);
+                if (errorMessage && errorMessage != ERROR_NONEXISTENT) return errorMessage;
+                applied.push_back(childmsgs[i]);
+            }
+            errorMessage = WriteNode(ptr, child);
+            if (errorMessage == ERROR_SIZE) {
+                // the leaf can't take them all after all, and wasn't
+                // written: split it and go again
+                applied.insert(applied.end(), later.begin(), later.end());
+                childmsgs.swap(applied);
+                if ((errorMessage = RelieveChild(node, best, true))) return errorMessage;
+                if ((errorMessage = parent.Unserialize(buffercache, node))) return errorMessage;
+                continue;
+            }
+            if (errorMessage) return errorMessage;
+            childmsgs.swap(later);
+            // the counts of node take in what its buffer holds, so that
+            // has to lose the applied messages before any recount
+            later = rest;
+            later.insert(later.end(), childmsgs.begin(), childmsgs.end());
+            if ((errorMessage = WriteMessages(parent, node, later))) return errorMessage;
+            if ((errorMessage = RecountChildren(node, best, best))) return errorMessage;
+            if ((errorMessage = RelieveChild(node, best))) return errorMessage;
+            if ((errorMessage = parent.Unserialize(buffercache, node))) return errorMessage;
+        }
+        rest.insert(rest.end(), childmsgs.begin(), childmsgs.end());
+    } else {
+        if ((errorMessage = ReadMessages(child, childmsgs))) return errorMessage;
+        if (childmsgs.size() >= MessageCapacity()) {
+            // make room further down, our caller will flush node again
+            if ((errorMessage = FlushNode(ptr))) return errorMessage;
+            if ((errorMessage = RecountChildren(node, best, best))) return errorMessage;
+            return RelieveChild(node, best);
+        }
+        room = MessageCapacity() - childmsgs.size();
+        for (SIZE_T i = 0; i < msgs.size(); i++) {
+            if (route[i] == best && room > 0) {
+                childmsgs.push_back(msgs[i]);
+                room--;
+                // the count node keeps for the child already took it in,
+                // the child's own counts take it in now
+                if (ext.counted && MessageDelta(msgs[i]) != 0) {
+                    if ((errorMessage = ChildPosition(child, msgs[i].key, position))) return errorMessage;
+                    SetChildCount(child, position, GetChildCount(child, position) + MessageDelta(msgs[i]));
+                    recount = true;
+                }
+            } else {
+                rest.push_back(msgs[i]);
+            }
+        }
+        if (recount && (errorMessage = child.Serialize(buffercache, ptr))) return errorMessage;
+        if ((errorMessage = WriteMessages(child, ptr, childmsgs))) return errorMessage;
+    }
+
+    return WriteMessages(parent, node, rest);
+}
+
+
+//
+// Add a message to the buffer of the root, flushing it until there's room
+//
+ERROR_T BTreeIndex::EnqueueMessage(const BTreeMessage &msg) {
+    BTreeNode root;
+    ERROR_T errorMessage;
+    SuperblockExt ext;
+    vector<BTreeMessage> msgs;
+    SIZE_T position;
+    long delta;
+
+    if ((errorMessage = root.Unserialize(buffercache, superblock.info.rootnode))) return errorMessage;
+    if (root.info.numkeys == 0) {
+        // no children to buffer for yet, but Update and Delete stay blind
+        errorMessage = ApplyMessage(msg);
+        if (errorMessage == ERROR_NONEXISTENT && (msg.op == BTREE_MSG_UPDATE || msg.op == BTREE_MSG_DELETE)) {
+            return ERROR_NOERROR;
+        }
+        return errorMessage;
+    }
+    if ((errorMessage = ReadMessages(root, msgs))) return errorMessage;
+    while (msgs.size() >= MessageCapacity()) {
+        if ((errorMessage = FlushNode(superblock.info.rootnode))) return errorMessage;
+        if ((errorMessage = RelieveRoot())) return errorMessage;
+        if ((errorMessage = root.Unserialize(buffercache, superblock.info.rootnode))) return errorMessage;
+        if ((errorMessage = ReadMessages(root, msgs))) return errorMessage;
+    }
+    msgs.push_back(msg);
+    if ((errorMessage = WriteMessages(root, superblock.info.rootnode, msgs))) return errorMessage;
+
+    // the counts take the message in right away, see Rank
+    GetSuperblockExt(ext);
+    delta = MessageDelta(msg);
+    if (!ext.counted || delta == 0) {
+        return ERROR_NOERROR;
+    }
+    if ((errorMessage = ChildPosition(root, msg.key, position))) return errorMessage;
+    SetChildCount(root, position, GetChildCount(root, position) + delta);
+    superblock.info.numkeys += delta;
+    return root.Serialize(buffercache, superblock.info.rootnode);
+}
+
+
+//
+// Take the pending messages out of every buffer under node, freeing the
+// buffer blocks.  Messages deeper down are older.  The counts give up
+// what the messages would have done, removed says how much that was
+// in all, so that applying them counts them again.
+//
+ERROR_T BTreeIndex::CollectMessages(const SIZE_T &node, const SIZE_T depth, vector<vector<BTreeMessage> > &bydepth,
+                                    long &removed) {
+    BTreeNode dummy;
+    ERROR_T errorMessage;
+    SuperblockExt ext;
+    vector<BTreeMessage> msgs;
+    SIZE_T position;
+    SIZE_T ptr;
+    long below;
+    bool changed = false;
+
+    removed = 0;
+    if ((errorMessage = dummy.Unserialize(buffercache, node))) return errorMessage;
+    if (dummy.info.nodetype == BTREE_LEAF_NODE || dummy.info.nodetype == BTREE_COMPRESSED_LEAF_NODE) {
+        return ERROR_NOERROR;
+    }
+    GetSuperblockExt(ext);
+    if (dummy.info.freelist != 0) {
+        if ((errorMessage = ReadMessages(dummy, msgs))) return errorMessage;
+        if (bydepth.size() <= depth) {
+            bydepth.resize(depth + 1);
+        }
+        bydepth[depth].insert(bydepth[depth].end(), msgs.begin(), msgs.end());
+        if ((errorMessage = DeallocateNode(dummy.info.freelist))) return errorMessage;
+        dummy.info.freelist = 0;
+        changed = true;
+        for (SIZE_T i = 0; ext.counted && i < msgs.size(); i++) {
+            if ((errorMessage = ChildPosition(dummy, msgs[i].key, position))) return errorMessage;
+            SetChildCount(dummy, position, GetChildCount(dummy, position) - MessageDelta(msgs[i]));
+            removed += MessageDelta(msgs[i]);
+        }
+    }
+    for (position = 0; dummy.info.numkeys > 0 && position <= dummy.info.numkeys; position++) {
+        if ((errorMessage = dummy.GetPtr(position, ptr))) return errorMessage;
+        if ((errorMessage = CollectMessages(ptr, depth + 1, bydepth, below))) return errorMessage;
+        if (ext.counted && below != 0) {
+            SetChildCount(dummy, position, GetChildCount(dummy, position) - below);
+            removed += below;
+            changed = true;
+        }
+    }
+    if (!changed) {
+        return ERROR_NOERROR;
+    }
+    return dummy.Serialize(buffercache, node);
+}
+
+
+ERROR_T BTreeIndex::FlushBuffers() {
+    ERROR_T errorMessage;
+    SuperblockExt ext;
+    vector<vector<BTreeMessage> > bydepth;
+    long removed;
+
+    // the buffers themselves say whether anything is pending, the
+    // whole tree is walked to find them
+    GetSuperblockExt(ext);
+    if (!ext.buffered) {
+        return RebuildStaleBloomFilter();
+    }
+    if ((errorMessage = CollectMessages(superblock.info.rootnode, 0, bydepth, removed))) return errorMessage;
+    superblock.info.numkeys -= removed;
+    for (SIZE_T depth = bydepth.size(); depth > 0; depth--) {
+        for (SIZE_T i = 0; i < bydepth[depth - 1].size(); i++) {
+            errorMessage = ApplyMessage(bydepth[depth - 1][i]);
+            if (errorMessage && errorMessage != ERROR_NONEXISTENT) return errorMessage;
+        }
+    }
+    return RebuildStaleBloomFilter();
+}
+
+
+//
+// Outside of buffered mode info.freelist of interior nodes is just a
+// copy of whatever their parent had, clear it before trusting it
+//
+ERROR_T BTreeIndex::ResetBufferPointers(const SIZE_T &node) {
+    BTreeNode dummy;
+    ERROR_T errorMessage;
+    SIZE_T position;
+    SIZE_T ptr;
+
+    if ((errorMessage = dummy.Unserialize(buffercache, node))) return errorMessage;
+    if (dummy.info.nodetype == BTREE_LEAF_NODE || dummy.info.nodetype == BTREE_COMPRESSED_LEAF_NODE) {
+        return ERROR_NOERROR;
+    }
+    dummy.info.freelist = 0;
+    if ((errorMessage = dummy.Serialize(buffercache, node))) return errorMessage;
+    if (dummy.info.numkeys == 0) {
+        return ERROR_NOERROR;
+    }
+    for (position = 0; position <= dummy.info.numkeys; position++) {
+        if ((errorMessage = dummy.GetPtr(position, ptr))) return errorMessage;
+        if ((errorMessage = ResetBufferPointers(ptr))) return errorMessage;
+    }
+    return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::SetBufferedMode(const bool buffered, const SIZE_T maxfanout) {
+    ERROR_T errorMessage;
+    SuperblockExt ext;
+
+    GetSuperblockExt(ext);
+    if (buffered && !ext.buffered) {
+        if ((errorMessage = ResetBufferPointers(superblock.info.rootnode))) return errorMessage;
+    }
+    if (!buffered && ext.buffered) {
+        if ((errorMessage = FlushBuffers())) return errorMessage;
+    }
+    GetSuperblockExt(ext);
+    ext.buffered = buffered ? 1 : 0;
+    // an interior node needs three keys to split
+    ext.maxfanout = maxfanout < 4 ? 4 : maxfanout;
+    SetSuperblockExt(ext);
+    return superblock.Serialize(buffercache, superblock_index);
+}
+
+
+//
+// Only indexes created since the counts were added keep them
+//
+ERROR_T BTreeIndex::PrepareCounts() {
+    SuperblockExt ext;
+
+    GetSuperblockExt(ext);
+    if (!ext.counted) {
+        return ERROR_UNIMPL;
+    }
+    return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::GetNumKeys(SIZE_T &count) {
+    ERROR_T errorMessage;
+
+    if ((errorMessage = PrepareCounts())) return errorMessage;
+    count = superblock.info.numkeys;
+    return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::Count(const KEY_T &lo, const KEY_T &hi, SIZE_T &count) {
+    ERROR_T errorMessage;
+    SIZE_T lorank, hirank;
+
+    if ((errorMessage = Rank(lo, lorank))) return errorMessage;
+    if ((errorMessage = Rank(hi, hirank))) return errorMessage;
+    count = (hirank > lorank) ? hirank - lorank : 0;
+    return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::Rank(const KEY_T &key, SIZE_T &rank) {
+    BTreeNode dummy;
+    ERROR_T errorMessage;
+    SuperblockExt ext;
+    vector<BTreeMessage> msgs;
+    SIZE_T node;
+    SIZE_T position, msgposition;
+    KEY_T testkey;
+
+    if ((errorMessage = PrepareCounts())) return errorMessage;
+    GetSuperblockExt(ext);
+    rank = 0;
+    node = superblock.info.rootnode;
+    for (;;) {
+        if ((errorMessage = ReadNode(node, dummy))) return errorMessage;
+        switch (dummy.info.nodetype) {
+            case BTREE_ROOT_NODE:
+            case BTREE_INTERIOR_NODE:
+                if (dummy.info.numkeys == 0) {
+                    return ERROR_NOERROR;
+                }
+                // everything left of the child key would be in is smaller
+                if ((errorMessage = ChildPosition(dummy, key, position))) return errorMessage;
+                for (SIZE_T i = 0; i < position; i++) {
+                    rank += GetChildCount(dummy, i);
+                }
+                // smaller keys waiting here for the child we go on into
+                // aren't in the counts below it
+                if (ext.buffered && (errorMessage = ReadMessages(dummy, msgs))) return errorMessage;
+                for (SIZE_T i = 0; i < msgs.size(); i++) {
+                    if ((errorMessage = ChildPosition(dummy, msgs[i].key, msgposition))) return errorMessage;
+                    if (msgposition == position && msgs[i].key < key) {
+                        rank += MessageDelta(msgs[i]);
+                    }
+                }
+                if ((errorMessage = dummy.GetPtr(position, node))) return errorMessage;
+                break;
+            case BTREE_LEAF_NODE:
+                for (position = 0; position < dummy.info.numkeys; position++) {
+                    if ((errorMessage = dummy.GetKey(position, testkey))) return errorMessage;
+                    if (!(testkey < key)) {
+                        break;
+                    }
+                }
+                rank += position;
+                return ERROR_NOERROR;
+            default:
+                return ERROR_INSANE;
+        }
+    }
+}
+
+
+ERROR_T BTreeIndex::Select(const SIZE_T k, KEY_T &key, VALUE_T &value) {
+    BTreeNode dummy;
+    ERROR_T errorMessage;
+    SuperblockExt ext;
+    vector<BTreeMessage> msgs, pending, down;
+    vector<KeyValuePair> entries;
+    vector<long> deltas;
+    SIZE_T node;
+    SIZE_T position;
+    SIZE_T remaining;
+    SIZE_T count;
+
+    if ((errorMessage = PrepareCounts())) return errorMessage;
+    if (k >= superblock.info.numkeys) {
+        return ERROR_NONEXISTENT;
+    }
+    GetSuperblockExt(ext);
+    remaining = k;
+    node = superblock.info.rootnode;
+    for (;;) {
+        if ((errorMessage = ReadNode(node, dummy))) return errorMessage;
+        switch (dummy.info.nodetype) {
+            case BTREE_ROOT_NODE:
+            case BTREE_INTERIOR_NODE:
+                if (dummy.info.numkeys == 0) {
+                    return ERROR_NONEXISTENT;
+                }
+                // the counts here don't take in the messages pending
+                // above, which came down with us
+                deltas.assign(dummy.info.numkeys + 1, 0);
+                for (SIZE_T i = 0; i < pending.size(); i++) {
+                    if ((errorMessage = ChildPosition(dummy, pending[i].key, position))) return errorMessage;
+                    deltas[position] += MessageDelta(pending[i]);
+                }
+                // skip whole subtrees until the one holding the entry
+                for (position = 0; position < dummy.info.numkeys; position++) {
+                    count = GetChildCount(dummy, position) + deltas[position];
+                    if (remaining < count) {
+                        break;
+                    }
+                    remaining -= count;
+                }
+                // those headed for that child go on down, after the
+                // older ones waiting here
+                if (ext.buffered && (errorMessage = ReadMessages(dummy, msgs))) return errorMessage;
+                down.clear();
+                if ((errorMessage = RouteMessages(dummy, msgs, position, down))) return errorMessage;
+                if ((errorMessage = RouteMessages(dummy, pending, position, down))) return errorMessage;
+                pending.swap(down);
+                if ((errorMessage = dummy.GetPtr(position, node))) return errorMessage;
+                break;
+            case BTREE_LEAF_NODE:
+                if ((errorMessage = MergedLeafEntries(dummy, pending, entries))) return errorMessage;
+                if (remaining >= entries.size()) {
+                    return ERROR_INSANE;
+                }
+                key = entries[remaining].key;
+                value = entries[remaining].value;
+                return ERROR_NOERROR;
+            default:
+                return ERROR_INSANE;
+        }
+    }
+}
+
+
+//
+// pending holds the messages from the buffers above node that are
+// headed for it, oldest first
+//
+ERROR_T BTreeIndex::ScanInternal(const SIZE_T &node, const KEY_T &lo, const SIZE_T maxentries,
+                                 const vector<BTreeMessage> &pending, vector<KeyValuePair> &entries) const {
+    BTreeNode dummy;
+    ERROR_T errorMessage;
+    SuperblockExt ext;
+    vector<BTreeMessage> msgs, down;
+    vector<KeyValuePair> leafentries;
+    SIZE_T position;
+    SIZE_T ptr;
+
+    if ((errorMessage = ReadNode(node, dummy))) return errorMessage;
+    switch (dummy.info.nodetype) {
+        case BTREE_ROOT_NODE:
+        case BTREE_INTERIOR_NODE:
+            if (dummy.info.numkeys == 0) {
+                return ERROR_NOERROR;
+            }
+            GetSuperblockExt(ext);
+            if (ext.buffered && (errorMessage = ReadMessages(dummy, msgs))) return errorMessage;
+            // children left of the one lo would be in only hold smaller keys
+            if ((errorMessage = ChildPosition(dummy, lo, position))) return errorMessage;
+            for (; position <= dummy.info.numkeys && entries.size() < maxentries; position++) {
+                if ((errorMessage = dummy.GetPtr(position, ptr))) return errorMessage;
+                down.clear();
+                if ((errorMessage = RouteMessages(dummy, msgs, position, down))) return errorMessage;
+                if ((errorMessage = RouteMessages(dummy, pending, position, down))) return errorMessage;
+                if ((errorMessage = ScanInternal(ptr, lo, maxentries, down, entries))) return errorMessage;
+            }
+            return ERROR_NOERROR;
+        case BTREE_LEAF_NODE:
+            if ((errorMessage = MergedLeafEntries(dummy, pending, leafentries))) return errorMessage;
+            for (position = 0; position < leafentries.size() && entries.size() < maxentries; position++) {
+                if (!(leafentries[position].key < lo)) {
+                    entries.push_back(leafentries[position]);
+                }
+            }
+            return ERROR_NOERROR;
+        default:
+            return ERROR_INSANE;
+    }
+}
+
+
+ERROR_T BTreeIndex::Scan(const KEY_T &lo, const SIZE_T maxentries, vector<KeyValuePair> &entries) {
+    SIZE_T target;
+
+    target = entries.size() + maxentries;
+    return ScanInternal(superblock.info.rootnode, lo, target, vector<BTreeMessage>(), entries);
+}
+
+
+//
+//
+// DEPTH first traversal
+// DOT is Depth + DOT format
+//
+
+ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node, ostream &o, BTreeDisplayType display_type) const {
+    KEY_T testkey;
+    SIZE_T ptr;
+    BTreeNode dummy;
+    ERROR_T errorMessage;
+    SIZE_T position;
+
+    errorMessage = ReadNode(node, dummy);
+
+    if (errorMessage != ERROR_NOERROR) {
+        return errorMessage;
+    }
+
+    errorMessage = PrintNode(o, node, dummy, display_type);
+
+    if (errorMessage) { return errorMessage; }
+
+    if (display_type == BTREE_DEPTH_DOT) {
+        o << ";";
+    }
+
+    if (display_type != BTREE_SORTED_KEYVAL) {
+        o << endl;
+    }
+
+    switch (dummy.info.nodetype) {
+        case BTREE_ROOT_NODE:
+        case BTREE_INTERIOR_NODE:
+            if (dummy.info.numkeys > 0) {
+                for (position = 0; position <= dummy.info.numkeys; position++) {
+                    errorMessage = dummy.GetPtr(position, ptr);
+                    if (errorMessage) { return errorMessage; }
+                    if (display_type == BTREE_DEPTH_DOT) {
+                        o << node << " -> " << ptr << ";\n";
+                    }
+                    errorMessage = DisplayInternal(ptr, o, display_type);
+                    if (errorMessage) { return errorMessage; }
+                }
+            }
+            return ERROR_NOERROR;
+            break;
+        case BTREE_LEAF_NODE:
+            return ERROR_NOERROR;
+            break;
+        default:
+            if (display_type == BTREE_DEPTH_DOT) {
+            } else {
+                o << "Unsupported Node Type " << dummy.info.nodetype;
+            }
+            return ERROR_INSANE;
+    }
+
+    return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::Display(ostream &o, BTreeDisplayType display_type) const {
+    ERROR_T errorMessage;
+    if (display_type == BTREE_DEPTH_DOT) {
+        o << "digraph tree { \n";
+    }
+    errorMessage = DisplayInternal(superblock.info.rootnode, o, display_type);
+    if (display_type == BTREE_DEPTH_DOT) {
+        o << "}\n";
+    }
+    return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::SanityCheckHelper(const SIZE_T &node, const KEY_T &key, const SIZE_T &isLeft) const {
+    BTreeNode dummy;
+    SIZE_T position;
+    KEY_T preKey;
     KEY_T curKey;
 
-    dummy.Unserialize(buffercache, node);
+    ReadNode(node, dummy);
 
     for (position = 0; position < dummy.info.numkeys; position++) {
         if (position == 0) {
@@ -679,6 +2840,47 @@ ERROR_T BTreeIndex::SanityCheck() const {
 }
 
 
+ERROR_T BTreeIndex::LeafUtilizationHelper(const SIZE_T &node, SIZE_T &entries, SIZE_T &slots) const {
+    BTreeNode dummy;
+    ERROR_T errorMessage;
+    SIZE_T position;
+    SIZE_T ptr;
+
+    if ((errorMessage = ReadNode(node, dummy))) return errorMessage;
+
+    switch (dummy.info.nodetype) {
+        case BTREE_ROOT_NODE:
+        case BTREE_INTERIOR_NODE:
+            if (dummy.info.numkeys == 0) {
+                return ERROR_NOERROR;
+            }
+            for (position = 0; position <= dummy.info.numkeys; position++) {
+                if ((errorMessage = dummy.GetPtr(position, ptr))) return errorMessage;
+                if ((errorMessage = LeafUtilizationHelper(ptr, entries, slots))) return errorMessage;
+            }
+            return ERROR_NOERROR;
+        case BTREE_LEAF_NODE:
+            // compressed leaves are widened when read, count raw slots
+            entries += dummy.info.numkeys;
+            slots += superblock.info.GetNumSlotsAsLeaf();
+            return ERROR_NOERROR;
+        default:
+            return ERROR_INSANE;
+    }
+}
+
+
+ERROR_T BTreeIndex::GetLeafUtilization(double &utilization) const {
+    ERROR_T errorMessage;
+    SIZE_T entries = 0;
+    SIZE_T slots = 0;
+
+    if ((errorMessage = LeafUtilizationHelper(superblock.info.rootnode, entries, slots))) return errorMessage;
+    utilization = slots ? (double) entries / (double) slots : 0.0;
+    return ERROR_NOERROR;
+}
+
+
 ostream &BTreeIndex::Print(ostream &os) const {
     Display(os, BTREE_DEPTH_DOT);
     return os;
@@ -3,6 +3,7 @@
 
 #include <iostream>
 #include <string>
+#include <vector>
 
 #include "global.h"
 #include "block.h"
@@ -10,6 +11,9 @@
 #include "buffercache.h"
 
 #include "btree_ds.h"
+#include "btree_cache.h"
+#include "btree_bloom.h"
+#include "btree_compress.h"
 
 using namespace std;
 
@@ -41,6 +45,108 @@ struct KeyValuePair {
 
 };
 
+// Blocks holding the bits of the bloom filter, chained through
+// info.freelist with info.numkeys bytes of bits in each
+#define BTREE_BLOOM_BLOCK 16
+
+// Deleted keys keep their bits set, so the filter is marked stale once
+// the deletes since the last rebuild pass 1/BTREE_BLOOM_REBUILD_RATIO
+// of the keys added to it, and rebuilt by the next FlushBuffers or
+// Detach
+#define BTREE_BLOOM_REBUILD_RATIO 4
+
+// The superblock's data area is otherwise unused, so index-wide settings
+// that don't fit in NodeMetadata are kept at its start.  A superblock
+// written before any of these existed won't carry the magic number and
+// reads back as all zeroes.
+#define BTREE_SUPERBLOCK_MAGIC 0x42545831
+
+struct SuperblockExt {
+    SIZE_T magic;
+    SIZE_T bloomblock;        // first block of the bloom filter, 0 if none
+    SIZE_T bloombits;
+    SIZE_T bloomhashes;
+    SIZE_T bloomclean;        // 0 if inserts happened since the bits were written
+    SIZE_T fillpercent;       // how full an edge split leaves a node
+    SIZE_T redistribute;      // 1 to relieve full leaves B*-tree style
+    SIZE_T buffered;          // 1 if interior nodes buffer messages
+    SIZE_T maxfanout;         // children per interior node when buffered
+    SIZE_T counted;           // 1 if interior nodes keep subtree counts
+    SIZE_T compressleaves;    // 1 if leaves are written compressed
+    SIZE_T bloomdeletes;      // deletes since the filter was last rebuilt
+    SIZE_T bloomkeys;         // keys added to the filter since then
+    SIZE_T bloomstale;        // 1 if enough deletes built up to rebuild it
+
+    SuperblockExt();
+};
+
+// In buffered mode each interior node may own a block of pending
+// messages, named by its info.freelist (0 if it has none).  The block
+// holds info.numkeys messages, oldest first, each an op byte followed
+// by the key and the value.  An update only takes effect if the key is
+// there when it reaches the leaves.  An insert is a put of a key known
+// to be absent, and with subtree counts a delete is only queued for a
+// key known to be there, so what a message does to the number of keys
+// is known as soon as it is queued.
+#define BTREE_MESSAGE_BLOCK 17
+
+enum BTreeMessageOp {
+    BTREE_MSG_PUT = 1, BTREE_MSG_DELETE = 2, BTREE_MSG_UPDATE = 3, BTREE_MSG_INSERT = 4
+};
+
+struct BTreeMessage {
+    SIZE_T op;
+    KEY_T key;
+    VALUE_T value;
+
+    BTreeMessage();
+
+    BTreeMessage(const SIZE_T op, const KEY_T &key, const VALUE_T &value);
+};
+
+// Combines the current value of a key with an operand into result.  All
+// three are valuesize bytes, existing is 0 if the key is absent, and
+// result may be the same memory as existing.
+typedef void (*BTreeMergeFn)(const char *existing, const char *operand, char *result, const SIZE_T valuesize);
+
+// Merges for values holding a little-endian unsigned integer of
+// valuesize bytes: add (wrapping) and maximum
+void BTreeMergeAdd(const char *existing, const char *operand, char *result, const SIZE_T valuesize);
+
+void BTreeMergeMax(const char *existing, const char *operand, char *result, const SIZE_T valuesize);
+
+// With subtree counts, interior nodes end with one count per child:
+// the number of leaf entries under it.  The counts are stored backwards
+// from the end of the data area, so the count of child i is the
+// (i+1)th SIZE_T from the end, and the node has fewer slots to make
+// room for them.  The superblock's info.numkeys holds the total, which
+// is only kept when the counts are.  In
+// buffered mode a count also takes in the messages headed for that
+// child, from the buffer of the node and those below it.
+
+// A compressed leaf is a block of this type with the info of the leaf.
+// Its data holds the length of the encoding (see LeafCodec), the leaf's
+// pointer and the encoding, which always fits: a leaf is relieved once
+// another entry might not fit, and a change that doesn't is not written
+// but made again after splitting the leaf.  A leaf read into memory
+// keeps the bytes it takes in its block in info.freelist, see LeafBytes.
+#define BTREE_COMPRESSED_LEAF_NODE 18
+
+// Leaves are decoded into ordinary leaf nodes this many blocks large,
+// so that a compressed leaf may hold up to this many times the entries
+// of a raw one
+#define BTREE_LEAF_EXPANSION 4
+
+// This many inserts in a row at the right (left) edge of their leaf
+// are taken to be an ascending (descending) key sequence
+#define BTREE_EDGE_RUN 3
+
+// A full leaf shifts entries into a sibling only if at least this
+// fraction (1/n) of the sibling's slots is free, or 100 - fillpercent
+// percent of them if that is more.  Levelling with less left both
+// leaves nearly full, so that the next insert split them two to three.
+#define BTREE_REDISTRIBUTE_SLACK 8
+
 enum BTreeOp {
     BTREE_OP_INSERT, BTREE_OP_DELETE, BTREE_OP_UPDATE, BTREE_OP_LOOKUP
 };
@@ -54,6 +160,12 @@ private:
     BufferCache *buffercache;
     SIZE_T superblock_index;
     BTreeNode superblock;
+    HotKeyCache *readcache;      // 0 unless EnableReadCache was called
+    BloomFilter *bloom;          // 0 unless EnableBloomFilter was called
+    LeafCodec *leafcodec;        // reads compressed leaves even when compression is off
+    vector<SIZE_T> bloomblocks;  // the blocks bloom is stored in
+    SIZE_T appendrun;            // inserts in a row at the end of their leaf
+    SIZE_T descendrun;           // inserts in a row at the start of their leaf
 
 protected:
 
@@ -61,20 +173,120 @@ protected:
 
     ERROR_T DeallocateNode(const SIZE_T &node);
 
+    ERROR_T ReadNode(const SIZE_T &block, BTreeNode &node) const;
+
+    ERROR_T WriteNode(const SIZE_T &block, BTreeNode &node);
+
+    SIZE_T LeafBlockSize() const;
+
+    SIZE_T LeafBytes(const BTreeNode &leaf) const;
+
+    ERROR_T FindInCompressedLeaf(const BTreeNode &block, const KEY_T &key, VALUE_T &value) const;
+
     ERROR_T LookupOrUpdateInternal(const SIZE_T &Node, const BTreeOp op, const KEY_T &key, VALUE_T &val);
 
     ERROR_T DisplayInternal(const SIZE_T &node, ostream &o, const BTreeDisplayType display_type = BTREE_DEPTH) const;
 
-    // SIZE_T IsFull(const SIZE_T &node);
+    SIZE_T InteriorSlots(const BTreeNode &node) const;
+
+    bool IsFull(const BTreeNode &node) const;
+
+    SIZE_T SplitPoint(const BTreeNode &node) const;
 
     ERROR_T SplitNode(const SIZE_T &node, SIZE_T &newNode, KEY_T &splitKey);
 
+    bool SpreadFits(const vector<BTreeNode> &leaves) const;
+
+    bool HasSlack(const BTreeNode &sibling) const;
+
+    ERROR_T RedistributeLeaves(const SIZE_T &node, BTreeNode &parent, const SIZE_T left, bool &moved);
+
+    ERROR_T SplitLeavesTwoToThree(const SIZE_T &node, BTreeNode &parent, const SIZE_T left, bool &moved);
+
+    ERROR_T RelieveChild(const SIZE_T &node, const SIZE_T position, const bool force = false);
+
+    ERROR_T MakeRoom(const SIZE_T &node, const SIZE_T position);
+
     ERROR_T InsertOneNode(const SIZE_T node, const KEY_T &key, const VALUE_T &value, const SIZE_T &newNode);
 
-    ERROR_T splitInsert(const SIZE_T &node, const KEY_T &key, const VALUE_T &value);
+    ERROR_T InsertIntoLeaf(BTreeNode &leaf, const KEY_T &key, const VALUE_T &value);
+
+    ERROR_T splitInsert(const SIZE_T &node, const KEY_T &key, const VALUE_T &value, BTreeMergeFn merge,
+                        bool &inserted);
+
+    ERROR_T UpsertLeaf(const SIZE_T &leaf, const KEY_T &key, const VALUE_T &value, BTreeMergeFn merge,
+                       bool &inserted);
+
+    ERROR_T InsertInternal(const KEY_T &key, const VALUE_T &value, BTreeMergeFn merge, bool &inserted);
+
+    ERROR_T RelieveRoot();
+
+    ERROR_T DeleteInternal(const SIZE_T &node, const KEY_T &key);
+
+    ERROR_T ChildPosition(const BTreeNode &node, const KEY_T &key, SIZE_T &position) const;
+
+    ERROR_T SubtreeCount(const SIZE_T &node, SIZE_T &count) const;
+
+    ERROR_T RecountChildren(const SIZE_T &node, const SIZE_T first, const SIZE_T last);
+
+    ERROR_T AdjustChildCount(const SIZE_T &node, const SIZE_T position, const int delta);
+
+    ERROR_T PrepareCounts();
+
+    ERROR_T ScanInternal(const SIZE_T &node, const KEY_T &lo, const SIZE_T maxentries,
+                         const vector<BTreeMessage> &pending, vector<KeyValuePair> &entries) const;
+
+    SIZE_T MessageCapacity() const;
+
+    ERROR_T ReadMessages(const BTreeNode &node, vector<BTreeMessage> &msgs) const;
+
+    ERROR_T WriteMessages(BTreeNode &node, const SIZE_T &nodeblock, const vector<BTreeMessage> &msgs);
+
+    ERROR_T SearchMessages(const BTreeNode &node, const KEY_T &key, VALUE_T &value, bool &found,
+                           bool &updated) const;
+
+    ERROR_T RouteMessages(const BTreeNode &node, const vector<BTreeMessage> &msgs, const SIZE_T position,
+                          vector<BTreeMessage> &routed) const;
+
+    ERROR_T ApplyMessage(const BTreeMessage &msg);
+
+    ERROR_T ApplyMessageToLeaf(const SIZE_T &leaf, const BTreeMessage &msg);
+
+    ERROR_T ApplyMessageInLeaf(BTreeNode &leaf, const BTreeMessage &msg);
+
+    ERROR_T FlushNode(const SIZE_T &node);
+
+    ERROR_T EnqueueMessage(const BTreeMessage &msg);
+
+    ERROR_T CollectMessages(const SIZE_T &node, const SIZE_T depth, vector<vector<BTreeMessage> > &bydepth,
+                            long &removed);
+
+    ERROR_T ResetBufferPointers(const SIZE_T &node);
 
     ERROR_T SanityCheckHelper(const SIZE_T &node, const KEY_T &key, const SIZE_T &isLeft) const;
 
+    ERROR_T LeafUtilizationHelper(const SIZE_T &node, SIZE_T &entries, SIZE_T &slots) const;
+
+    void GetSuperblockExt(SuperblockExt &ext) const;
+
+    void SetSuperblockExt(const SuperblockExt &ext);
+
+    ERROR_T BloomAddSubtree(const SIZE_T &node, SIZE_T &added);
+
+    ERROR_T ReadBloomFilter();
+
+    ERROR_T WriteBloomFilter();
+
+    ERROR_T FreeBloomBlocks();
+
+    ERROR_T NoteBloomDirty();
+
+    ERROR_T BloomAdd(const KEY_T &key);
+
+    void NoteBloomDelete();
+
+    ERROR_T RebuildStaleBloomFilter();
+
 public:
     //
     // keysize and valueszie should be stored in the
@@ -120,22 +332,135 @@ public:
     // return ERROR_CONFLICT if the key already exists and it's a unique index
     ERROR_T Insert(const KEY_T &key, const VALUE_T &value);
 
+    // Insert key, or overwrite its value if it already exists, with a
+    // single descent of the tree
+    // return zero on success
+    // return ERROR_NOSPACE if you run out of disk space
+    ERROR_T Upsert(const KEY_T &key, const VALUE_T &value);
+
+    // Replace the value of key with merge(value, operand), or insert it
+    // with merge(absent, operand), with a single descent of the tree.
+    // In buffered mode the current value is looked up first.
+    // return zero on success
+    // return ERROR_NOSPACE if you run out of disk space
+    ERROR_T Merge(const KEY_T &key, const VALUE_T &operand, BTreeMergeFn merge);
+
     ERROR_T Connect(const SIZE_T &node, const KEY_T &key, const SIZE_T &leftnode, const SIZE_T &rightnode); 
 
     // return zero on success
     // return ERROR_NONEXISTENT  if the key doesn't exist
     // return ERROR_SIZE if the key or value are the wrong size for this index
+    // In buffered mode the update is queued without looking for the key,
+    // so it returns zero either way and does nothing if the key is absent
     ERROR_T Update(const KEY_T &key, const VALUE_T &value);
 
     // return zero on success
     // return ERROR_NONEXISTENT  if the key doesn't exist
     // return ERROR_SIZE if the key or value are the wrong size for this index
+    // Leaves are not merged, a leaf may be left empty
+    // In buffered mode, as with Update, it returns zero either way
     ERROR_T Delete(const KEY_T &key);
 
     // return zero on success
     // return ERROR_NONEXISTENT  if the key doesn't exist
     ERROR_T Lookup(const KEY_T &key, VALUE_T &value);
 
+    // Put a cache of up to capacity recently read entries in front of
+    // Lookup.  A capacity of zero removes the cache.  The cache is kept
+    // coherent by Insert, Update and Delete.
+    ERROR_T EnableReadCache(const SIZE_T capacity);
+
+    // return ERROR_NONEXISTENT if there is no read cache
+    ERROR_T GetReadCacheStats(HotKeyCacheStats &stats) const;
+
+    // Keep a bloom filter of numbits bits over the keys in the index so
+    // that lookups of absent keys, including the conflict check done by
+    // Insert, return without traversing the tree.  numhashes=0 picks a
+    // default.  The filter is built from the current contents, stored
+    // in blocks referenced from the superblock and reloaded by Attach.
+    // numbits=0 drops the filter and frees its blocks.
+    // return ERROR_NOSPACE if there are not enough free blocks for it
+    ERROR_T EnableBloomFilter(const SIZE_T numbits, const SIZE_T numhashes = 0);
+
+    // Deleted keys leave their bits set, which only costs false
+    // positives.  This rebuilds the filter from the keys in the tree and
+    // its buffers.  Delete only marks the filter stale once enough
+    // deletes have built up, FlushBuffers and Detach then rebuild it.
+    ERROR_T RebuildBloomFilter();
+
+    // return ERROR_NONEXISTENT if there is no bloom filter
+    ERROR_T GetBloomFilterStats(BloomFilterStats &stats) const;
+
+    // How nodes make room when they fill up, stored in the superblock.
+    // When inserts arrive in ascending or descending key order, the full
+    // node is split at that edge and keeps fillpercent of its keys.
+    // Otherwise, if redistribute is set, a full leaf first shifts entries
+    // into a sibling with room, and two full leaves are split into three.
+    // return ERROR_SIZE if fillpercent is not in 50..100
+    ERROR_T SetSplitPolicy(const SIZE_T fillpercent, const bool redistribute = true);
+
+    // fraction of the leaf slots in the tree that hold an entry, counting
+    // the slots of a raw leaf block.  Compressed leaves hold more entries
+    // than that, so with them it can exceed 1.
+    ERROR_T GetLeafUtilization(double &utilization) const;
+
+    // Write-optimized (B-epsilon) mode.  Insert, Update and Delete become
+    // messages added to a buffer at the root, and a full buffer is
+    // flushed in one batch to the child with the most pending messages.
+    // Interior nodes are limited to maxfanout children so that each batch
+    // is large.  Lookup checks the buffers on its way down.  Turning the
+    // mode off flushes everything to the leaves.
+    //
+    // Update is queued blind, see above, as is Delete without subtree
+    // counts.  Insert still looks the key up, through the buffers on
+    // the way down, to report a conflict; with counts Upsert and Delete
+    // look it up too, so that the counts can take in what their message
+    // will do.  Each such lookup is a full descent unless the read cache
+    // has the key or the bloom filter rules it out, so keeping a filter
+    // is recommended.
+    ERROR_T SetBufferedMode(const bool buffered, const SIZE_T maxfanout = 16);
+
+    // Push every pending message down to the leaves, for instance before
+    // Display or SanityCheck, which only look at the leaves.  A bloom
+    // filter marked stale by deletes is rebuilt here too.
+    ERROR_T FlushBuffers();
+
+    // Write leaves compressed from now on: the keys after their common
+    // prefix frame-of-reference bit-packed, the values with a small
+    // LZ77-style codec.  Compressed leaves fill up once another entry
+    // might not fit in their block, so they hold more entries and scans
+    // read fewer blocks.  Leaves are converted as they are next written, turning
+    // it off leaves compressed those that don't fit raw.
+    ERROR_T SetLeafCompression(const bool compress);
+
+    // return ERROR_NONEXISTENT if the index isn't attached
+    ERROR_T GetLeafCompressionStats(LeafCompressionStats &stats) const;
+
+    // Order statistics in O(height), from the subtree counts.  Indexes
+    // created before the counts existed don't have them and get
+    // ERROR_UNIMPL.  In buffered mode nothing is flushed: the counts
+    // already take in pending messages, and those in the buffers on the
+    // way down are looked at as the query passes them.
+    //
+    // number of keys in the index
+    ERROR_T GetNumKeys(SIZE_T &count);
+
+    // number of keys k with lo <= k < hi
+    ERROR_T Count(const KEY_T &lo, const KEY_T &hi, SIZE_T &count);
+
+    // number of keys smaller than key, whether or not key is present
+    ERROR_T Rank(const KEY_T &key, SIZE_T &rank);
+
+    // the entry with k keys before it
+    // return ERROR_NONEXISTENT if k is not smaller than the number of keys
+    ERROR_T Select(const SIZE_T k, KEY_T &key, VALUE_T &value);
+
+    // Append up to maxentries entries with keys not smaller than lo to
+    // entries, in key order.  In buffered mode the pending messages
+    // headed for each leaf are merged into its entries as it is read,
+    // without flushing them.
+    ERROR_T Scan(const KEY_T &lo, const SIZE_T maxentries, vector<KeyValuePair> &entries);
+
     // Here you should figure out if your index makes sense
     // Is it a tree?  Is it in order?  Is it balanced?  Does each node have
     // a valid use ratio?
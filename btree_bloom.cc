@@ -0,0 +1,101 @@
+#include <string.h>
+#include "btree_bloom.h"
+
+BloomFilterStats::BloomFilterStats() : numbits(0), numhashes(0), bitsset(0), negatives(0), positives(0),
+                                       falsepositives(0) { }
+
+
+ostream &BloomFilterStats::Print(ostream &os) const {
+    os << "BloomFilter(bits=" << bitsset << "/" << numbits
+       << ", hashes=" << numhashes
+       << ", negatives=" << negatives
+       << ", positives=" << positives
+       << ", falsepositives=" << falsepositives << ")";
+    return os;
+}
+
+
+BloomFilter::BloomFilter(SIZE_T ks, SIZE_T nbits, SIZE_T nhashes)
+        : keysize(ks), numbits(nbits), numhashes(nhashes), negatives(0), positives(0), falsepositives(0) {
+    if (numbits == 0) {
+        numbits = 8;
+    }
+    if (numhashes == 0) {
+        numhashes = 1;
+    }
+    bits.assign((numbits + 7) / 8, 0);
+}
+
+
+BloomFilter::~BloomFilter() {
+    // shouldn't have to do anything
+}
+
+
+void BloomFilter::Hash(const Block &key, unsigned long long &h1, unsigned long long &h2) const {
+    // FNV-1a, then a murmur style finalizer for the second hash
+    h1 = 14695981039346656037ULL;
+    for (SIZE_T i = 0; i < keysize; i++) {
+        h1 ^= (unsigned char) key.data[i];
+        h1 *= 1099511628211ULL;
+    }
+    h2 = h1;
+    h2 ^= h2 >> 33;
+    h2 *= 0xff51afd7ed558ccdULL;
+    h2 ^= h2 >> 33;
+    h2 *= 0xc4ceb9fe1a85ec53ULL;
+    h2 ^= h2 >> 33;
+    h2 |= 1;
+}
+
+
+void BloomFilter::Add(const Block &key) {
+    unsigned long long h1, h2;
+    SIZE_T bit;
+
+    Hash(key, h1, h2);
+    for (SIZE_T i = 0; i < numhashes; i++) {
+        bit = (SIZE_T) ((h1 + i * h2) % numbits);
+        bits[bit / 8] |= (unsigned char) (1 << (bit % 8));
+    }
+}
+
+
+bool BloomFilter::MayContain(const Block &key) {
+    unsigned long long h1, h2;
+    SIZE_T bit;
+
+    Hash(key, h1, h2);
+    for (SIZE_T i = 0; i < numhashes; i++) {
+        bit = (SIZE_T) ((h1 + i * h2) % numbits);
+        if (!(bits[bit / 8] & (1 << (bit % 8)))) {
+            negatives++;
+            return false;
+        }
+    }
+    positives++;
+    return true;
+}
+
+
+void BloomFilter::NoteFalsePositive() {
+    falsepositives++;
+}
+
+
+void BloomFilter::Clear() {
+    memset(&bits[0], 0, bits.size());
+}
+
+
+void BloomFilter::GetStats(BloomFilterStats &stats) const {
+    stats = BloomFilterStats();
+    stats.numbits = numbits;
+    stats.numhashes = numhashes;
+    for (SIZE_T i = 0; i < bits.size(); i++) {
+        stats.bitsset += __builtin_popcount(bits[i]);
+    }
+    stats.negatives = negatives;
+    stats.positives = positives;
+    stats.falsepositives = falsepositives;
+}
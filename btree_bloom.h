@@ -0,0 +1,78 @@
+#ifndef _btree_bloom
+#define _btree_bloom
+
+#include <iostream>
+#include <vector>
+
+#include "global.h"
+#include "block.h"
+
+using namespace std;
+
+// Counters describing how often the filter saved a traversal
+struct BloomFilterStats {
+    SIZE_T numbits;
+    SIZE_T numhashes;
+    SIZE_T bitsset;
+    unsigned long long negatives;        // definite misses, no traversal
+    unsigned long long positives;        // maybe present, tree consulted
+    unsigned long long falsepositives;   // maybe present, but it wasn't
+
+    BloomFilterStats();
+
+    ostream &Print(ostream &os) const;
+};
+
+//
+// A plain Bloom filter over fixed size keys.  The k probe positions are
+// derived from two 64 bit hashes of the key (Kirsch-Mitzenmacher double
+// hashing), so each probe costs a multiply and an add.
+//
+// The bits are exposed so that the index can store them in its own
+// blocks.
+//
+class BloomFilter {
+private:
+    SIZE_T keysize;
+    SIZE_T numbits;
+    SIZE_T numhashes;
+    vector<unsigned char> bits;
+
+    unsigned long long negatives;
+    unsigned long long positives;
+    unsigned long long falsepositives;
+
+    void Hash(const Block &key, unsigned long long &h1, unsigned long long &h2) const;
+
+public:
+    BloomFilter(SIZE_T keysize, SIZE_T numbits, SIZE_T numhashes);
+
+    virtual ~BloomFilter();
+
+    void Add(const Block &key);
+
+    // false means the key was definitely never added
+    bool MayContain(const Block &key);
+
+    // the tree did not have a key that MayContain let through
+    void NoteFalsePositive();
+
+    void Clear();
+
+    SIZE_T GetNumBits() const { return numbits; }
+
+    SIZE_T GetNumHashes() const { return numhashes; }
+
+    SIZE_T GetNumBytes() const { return bits.size(); }
+
+    unsigned char *GetBits() { return &bits[0]; }
+
+    const unsigned char *GetBits() const { return &bits[0]; }
+
+    void GetStats(BloomFilterStats &stats) const;
+};
+
+
+inline ostream &operator<<(ostream &os, const BloomFilterStats &s) { return s.Print(os); }
+
+#endif
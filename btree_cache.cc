@@ -0,0 +1,153 @@
+#include <functional>
+#include "btree_cache.h"
+
+HotKeyCacheStats::HotKeyCacheStats() : capacity(0), entries(0), hits(0), misses(0), evictions(0),
+                                       invalidations(0) { }
+
+
+double HotKeyCacheStats::HitRate() const {
+    if (hits + misses == 0) {
+        return 0.0;
+    }
+    return (double) hits / (double) (hits + misses);
+}
+
+
+ostream &HotKeyCacheStats::Print(ostream &os) const {
+    os << "HotKeyCache(entries=" << entries << "/" << capacity
+       << ", hits=" << hits << ", misses=" << misses
+       << ", hitrate=" << HitRate()
+       << ", evictions=" << evictions
+       << ", invalidations=" << invalidations << ")";
+    return os;
+}
+
+
+HotKeyCache::HotKeyCache(SIZE_T ks, SIZE_T cap) : keysize(ks), capacity(cap) {
+    // split capacity exactly, using fewer stripes if it is small, so
+    // that the stripes together never hold more than capacity entries
+    numstripes = capacity < NUM_STRIPES ? capacity : NUM_STRIPES;
+    if (numstripes == 0) {
+        numstripes = 1;
+    }
+    for (SIZE_T i = 0; i < numstripes; i++) {
+        stripes[i].capacity = capacity / numstripes + (i < capacity % numstripes ? 1 : 0);
+    }
+}
+
+
+HotKeyCache::~HotKeyCache() {
+    // shouldn't have to do anything
+}
+
+
+string HotKeyCache::MakeKey(const Block &key) const {
+    return string(key.data, keysize);
+}
+
+
+HotKeyCache::Stripe &HotKeyCache::StripeFor(const string &key) {
+    return stripes[hash<string>()(key) % numstripes];
+}
+
+
+bool HotKeyCache::Get(const Block &key, Block &value) {
+    string k = MakeKey(key);
+    Stripe &s = StripeFor(k);
+    lock_guard<mutex> guard(s.lock);
+
+    unordered_map<string, list<Entry>::iterator>::iterator it = s.index.find(k);
+    if (it == s.index.end()) {
+        s.misses++;
+        return false;
+    }
+    // move to the front of the LRU list
+    s.lru.splice(s.lru.begin(), s.lru, it->second);
+    value = it->second->value;
+    s.hits++;
+    return true;
+}
+
+
+void HotKeyCache::Put(const Block &key, const Block &value) {
+    string k = MakeKey(key);
+    Stripe &s = StripeFor(k);
+    lock_guard<mutex> guard(s.lock);
+
+    unordered_map<string, list<Entry>::iterator>::iterator it = s.index.find(k);
+    if (it != s.index.end()) {
+        it->second->value = value;
+        s.lru.splice(s.lru.begin(), s.lru, it->second);
+        return;
+    }
+    if (s.capacity == 0) {
+        return;
+    }
+    if (s.lru.size() >= s.capacity) {
+        s.index.erase(s.lru.back().key);
+        s.lru.pop_back();
+        s.evictions++;
+    }
+    s.lru.push_front(Entry(k, value));
+    s.index[k] = s.lru.begin();
+}
+
+
+void HotKeyCache::Refresh(const Block &key, const Block &value) {
+    string k = MakeKey(key);
+    Stripe &s = StripeFor(k);
+    lock_guard<mutex> guard(s.lock);
+
+    unordered_map<string, list<Entry>::iterator>::iterator it = s.index.find(k);
+    if (it != s.index.end()) {
+        it->second->value = value;
+    }
+}
+
+
+void HotKeyCache::Invalidate(const Block &key) {
+    string k = MakeKey(key);
+    Stripe &s = StripeFor(k);
+    lock_guard<mutex> guard(s.lock);
+
+    unordered_map<string, list<Entry>::iterator>::iterator it = s.index.find(k);
+    if (it != s.index.end()) {
+        s.lru.erase(it->second);
+        s.index.erase(it);
+        s.invalidations++;
+    }
+}
+
+
+void HotKeyCache::Clear() {
+    for (SIZE_T i = 0; i < NUM_STRIPES; i++) {
+        lock_guard<mutex> guard(stripes[i].lock);
+        stripes[i].lru.clear();
+        stripes[i].index.clear();
+    }
+}
+
+
+void HotKeyCache::GetStats(HotKeyCacheStats &stats) const {
+    stats = HotKeyCacheStats();
+    stats.capacity = capacity;
+    for (SIZE_T i = 0; i < NUM_STRIPES; i++) {
+        lock_guard<mutex> guard(stripes[i].lock);
+        stats.entries += stripes[i].lru.size();
+        stats.hits += stripes[i].hits;
+        stats.misses += stripes[i].misses;
+        stats.evictions += stripes[i].evictions;
+        stats.invalidations += stripes[i].invalidations;
+    }
+}
+
+
+void HotKeyCache::ResetStats() {
+    for (SIZE_T i = 0; i < NUM_STRIPES; i++) {
+        lock_guard<mutex> guard(stripes[i].lock);
+        stripes[i].hits = 0;
+        stripes[i].misses = 0;
+        stripes[i].evictions = 0;
+        stripes[i].invalidations = 0;
+    }
+}
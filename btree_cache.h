@@ -0,0 +1,105 @@
+#ifndef _btree_cache
+#define _btree_cache
+
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "global.h"
+#include "block.h"
+
+using namespace std;
+
+// Counters describing how well the hot key cache is doing
+struct HotKeyCacheStats {
+    SIZE_T capacity;
+    SIZE_T entries;
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    unsigned long long invalidations;
+
+    HotKeyCacheStats();
+
+    double HitRate() const;
+
+    ostream &Print(ostream &os) const;
+};
+
+//
+// A size-bounded cache of recently read key -> value entries that sits
+// in front of the tree.  The table is split into independently locked
+// stripes, each with its own LRU list, so concurrent readers of
+// different keys do not contend on a single lock.
+//
+class HotKeyCache {
+private:
+    static const SIZE_T NUM_STRIPES = 16;
+
+    struct Entry {
+        string key;
+        Block value;
+
+        Entry(const string &k, const Block &v) : key(k), value(v) { }
+    };
+
+    struct Stripe {
+        mutable mutex lock;
+        list<Entry> lru;                                  // most recent first
+        unordered_map<string, list<Entry>::iterator> index;
+        unsigned long long hits;
+        unsigned long long misses;
+        unsigned long long evictions;
+        unsigned long long invalidations;
+        SIZE_T capacity;                                  // this stripe's share
+
+        Stripe() : hits(0), misses(0), evictions(0), invalidations(0), capacity(0) { }
+    };
+
+    SIZE_T keysize;
+    SIZE_T capacity;
+    SIZE_T numstripes;                                    // stripes in use
+    Stripe stripes[NUM_STRIPES];
+
+    string MakeKey(const Block &key) const;
+
+    Stripe &StripeFor(const string &key);
+
+    // Not copyable, the stripes own their locks
+    HotKeyCache(const HotKeyCache &rhs);
+
+    HotKeyCache &operator=(const HotKeyCache &rhs);
+
+public:
+    // capacity is the total number of entries held across all stripes
+    HotKeyCache(SIZE_T keysize, SIZE_T capacity);
+
+    virtual ~HotKeyCache();
+
+    SIZE_T GetCapacity() const { return capacity; }
+
+    // return true and fill in value if the key is cached
+    bool Get(const Block &key, Block &value);
+
+    // add or replace an entry, evicting the least recently used
+    // entry of its stripe if the stripe is full
+    void Put(const Block &key, const Block &value);
+
+    // replace the value of an entry, but only if it is already cached
+    void Refresh(const Block &key, const Block &value);
+
+    void Invalidate(const Block &key);
+
+    void Clear();
+
+    void GetStats(HotKeyCacheStats &stats) const;
+
+    void ResetStats();
+};
+
+
+inline ostream &operator<<(ostream &os, const HotKeyCacheStats &s) { return s.Print(os); }
+
+#endif
@@ -0,0 +1,552 @@
+#include <chrono>
+#include <string.h>
+#include "btree_compress.h"
+
+// header: flags, prefix length, key width, then the 8 byte base
+#define LEAF_HEADER_BYTES 11
+#define LEAF_VALUES_LZ 1
+#define LEAF_RAW_SUFFIXES 0xff
+// the prefix length has to fit its one header byte
+#define LEAF_MAX_PREFIX 0xff
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+
+LeafCompressionStats::LeafCompressionStats() : leavesencoded(0), rawbytes(0), encodedbytes(0), leavesdecoded(0),
+                                               decodenanos(0) { }
+
+
+double LeafCompressionStats::Ratio() const {
+    if (encodedbytes == 0) {
+        return 0.0;
+    }
+    return (double) rawbytes / (double) encodedbytes;
+}
+
+
+double LeafCompressionStats::NanosPerDecode() const {
+    if (leavesdecoded == 0) {
+        return 0.0;
+    }
+    return (double) decodenanos / (double) leavesdecoded;
+}
+
+
+ostream &LeafCompressionStats::Print(ostream &os) const {
+    os << "LeafCompression(encoded=" << leavesencoded
+       << ", ratio=" << Ratio()
+       << ", decoded=" << leavesdecoded
+       << ", ns/decode=" << NanosPerDecode() << ")";
+    return os;
+}
+
+
+//
+// The parts of an encoded leaf
+//
+struct EncodedLeaf {
+    unsigned flags;
+    SIZE_T prefixlen;
+    unsigned width;
+    unsigned long long base;
+    const char *prefix;
+    const char *keys;
+    SIZE_T keybytes;
+    const char *values;
+    SIZE_T valuebytes;
+};
+
+
+static unsigned long long ReadSuffix(const char *key, const SIZE_T len) {
+    unsigned long long v = 0;
+
+    for (SIZE_T i = 0; i < len; i++) {
+        v = (v << 8) | (unsigned char) key[i];
+    }
+    return v;
+}
+
+
+static void WriteSuffix(char *key, const SIZE_T len, unsigned long long v) {
+    for (SIZE_T i = len; i > 0; i--) {
+        key[i - 1] = (char) (v & 0xff);
+        v >>= 8;
+    }
+}
+
+
+static SIZE_T PackedBytes(const SIZE_T numkeys, const unsigned width) {
+    return (SIZE_T) (((unsigned long long) numkeys * width + 63) / 64 * 8);
+}
+
+
+//
+// Offset i occupies bits i*width.. of a little-endian stream of 64 bit
+// words.  There's a zero word past the end so that neither loop needs
+// to branch on whether an offset straddles two words; (x >> 1) >> (63-s)
+// is x >> (64-s) without the undefined shift by 64 when s is 0.  At
+// width 0 every offset is zero and there is nothing to store.
+//
+static void PackOffsets(const vector<unsigned long long> &offsets, const unsigned width, char *out) {
+    vector<unsigned long long> words(PackedBytes(offsets.size(), width) / 8 + 1, 0);
+    unsigned long long bit;
+    unsigned shift;
+
+    if (width == 0) {
+        return;
+    }
+    for (SIZE_T i = 0; i < offsets.size(); i++) {
+        bit = (unsigned long long) i * width;
+        shift = (unsigned) (bit & 63);
+        words[bit >> 6] |= offsets[i] << shift;
+        words[(bit >> 6) + 1] |= (offsets[i] >> 1) >> (63 - shift);
+    }
+    memcpy(out, &words[0], PackedBytes(offsets.size(), width));
+}
+
+
+static void UnpackOffsets(const char *in, const SIZE_T numkeys, const unsigned width,
+                          vector<unsigned long long> &offsets) {
+    vector<unsigned long long> words(PackedBytes(numkeys, width) / 8 + 1, 0);
+    unsigned long long mask = (width == 64) ? ~0ULL : (1ULL << width) - 1;
+    unsigned long long bit;
+    unsigned shift;
+
+    offsets.assign(numkeys, 0);
+    if (width == 0) {
+        return;
+    }
+    memcpy(&words[0], in, PackedBytes(numkeys, width));
+    for (SIZE_T i = 0; i < numkeys; i++) {
+        bit = (unsigned long long) i * width;
+        shift = (unsigned) (bit & 63);
+        offsets[i] = ((words[bit >> 6] >> shift) | ((words[(bit >> 6) + 1] << 1) << (63 - shift))) & mask;
+    }
+}
+
+
+//
+// Offset i read straight from the packed words, as UnpackOffsets would.
+// The word after the one it starts in is only read if the offset runs
+// into it, as it may be past the end.
+//
+static unsigned long long PackedOffset(const char *in, const unsigned width, const SIZE_T i) {
+    unsigned long long mask = (width == 64) ? ~0ULL : (1ULL << width) - 1;
+    unsigned long long bit = (unsigned long long) i * width;
+    unsigned shift = (unsigned) (bit & 63);
+    unsigned long long lo, hi = 0;
+
+    if (width == 0) {
+        return 0;
+    }
+    memcpy(&lo, in + (bit >> 6) * 8, 8);
+    if (shift + width > 64) {
+        memcpy(&hi, in + ((bit >> 6) + 1) * 8, 8);
+    }
+    return ((lo >> shift) | ((hi << 1) << (63 - shift))) & mask;
+}
+
+
+static void PutLength(vector<char> &out, SIZE_T len) {
+    while (len >= 255) {
+        out.push_back((char) 255);
+        len -= 255;
+    }
+    out.push_back((char) len);
+}
+
+
+static bool GetLength(const unsigned char *in, const SIZE_T len, SIZE_T &ip, SIZE_T &length) {
+    unsigned char b;
+
+    do {
+        if (ip >= len) {
+            return false;
+        }
+        b = in[ip++];
+        length += b;
+    } while (b == 255);
+    return true;
+}
+
+
+static void PutSequence(vector<char> &out, const unsigned char *literals, const SIZE_T numliterals,
+                        const SIZE_T offset, const SIZE_T matchlen) {
+    SIZE_T m = matchlen ? matchlen - LZ_MIN_MATCH : 0;
+
+    out.push_back((char) (((numliterals < 15 ? numliterals : 15) << 4) | (m < 15 ? m : 15)));
+    if (numliterals >= 15) {
+        PutLength(out, numliterals - 15);
+    }
+    out.insert(out.end(), literals, literals + numliterals);
+    if (matchlen == 0) {
+        return;
+    }
+    out.push_back((char) (offset & 0xff));
+    out.push_back((char) (offset >> 8));
+    if (m >= 15) {
+        PutLength(out, m - 15);
+    }
+}
+
+
+//
+// A small LZ77 codec of our own, not meant to read or write any other
+// format: each sequence is a token, literals, and a match given as a 16
+// bit offset back into the output.  The last sequence is only literals.
+// Matches are found through a table of the last position each hash of 4
+// bytes was seen at.
+//
+static void LZCompress(const unsigned char *src, const SIZE_T len, vector<char> &out) {
+    vector<SIZE_T> table(1 << LZ_HASH_BITS, (SIZE_T) -1);
+    SIZE_T anchor = 0;
+    SIZE_T i = 0;
+    SIZE_T candidate, matchlen;
+    unsigned seq, h;
+
+    out.clear();
+    while (i + LZ_MIN_MATCH <= len) {
+        memcpy(&seq, src + i, 4);
+        h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        candidate = table[h];
+        table[h] = i;
+        if (candidate == (SIZE_T) -1 || i - candidate > LZ_MAX_OFFSET || memcmp(src + candidate, src + i, 4) != 0) {
+            i++;
+            continue;
+        }
+        matchlen = LZ_MIN_MATCH;
+        while (i + matchlen < len && src[candidate + matchlen] == src[i + matchlen]) {
+            matchlen++;
+        }
+        PutSequence(out, src + anchor, i - anchor, i - candidate, matchlen);
+        i += matchlen;
+        anchor = i;
+    }
+    PutSequence(out, src + anchor, len - anchor, 0, 0);
+}
+
+
+//
+// Decompress the first want of the outlen bytes in decompresses to, out
+// needs room for want bytes.  Only a whole decompression checks that
+// the rest of in is well formed.
+//
+static bool LZDecompress(const unsigned char *in, const SIZE_T len, unsigned char *out, const SIZE_T outlen,
+                         const SIZE_T want) {
+    SIZE_T ip = 0;
+    SIZE_T op = 0;
+    SIZE_T literals, matchlen, offset;
+    unsigned char token;
+
+    while (ip < len) {
+        token = in[ip++];
+        literals = token >> 4;
+        if (literals == 15 && !GetLength(in, len, ip, literals)) {
+            return false;
+        }
+        if (literals > len - ip || literals > outlen - op) {
+            return false;
+        }
+        if (literals >= want - op && want < outlen) {
+            memcpy(out + op, in + ip, want - op);
+            return true;
+        }
+        memcpy(out + op, in + ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == len) {
+            break;
+        }
+
+        if (len - ip < 2) {
+            return false;
+        }
+        offset = in[ip] | (in[ip + 1] << 8);
+        ip += 2;
+        matchlen = token & 15;
+        if (matchlen == 15 && !GetLength(in, len, ip, matchlen)) {
+            return false;
+        }
+        matchlen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || matchlen > outlen - op) {
+            return false;
+        }
+        if (matchlen >= want - op && want < outlen) {
+            matchlen = want - op;
+        }
+        // the match may overlap what it is copying, so go byte by byte
+        for (SIZE_T i = 0; i < matchlen; i++, op++) {
+            out[op] = out[op - offset];
+        }
+        if (op == want && want < outlen) {
+            return true;
+        }
+    }
+    return op == outlen;
+}
+
+
+static bool ParseLeaf(const char *in, const SIZE_T len, const SIZE_T numkeys, const SIZE_T keysize,
+                      EncodedLeaf &leaf) {
+    SIZE_T offset;
+    unsigned valuebytes;
+
+    if (len < LEAF_HEADER_BYTES) {
+        return false;
+    }
+    leaf.flags = (unsigned char) in[0];
+    leaf.prefixlen = (unsigned char) in[1];
+    leaf.width = (unsigned char) in[2];
+    memcpy(&leaf.base, in + 3, 8);
+    if (leaf.prefixlen > keysize || (leaf.width != LEAF_RAW_SUFFIXES && leaf.width > 64)) {
+        return false;
+    }
+    leaf.keybytes = (leaf.width == LEAF_RAW_SUFFIXES) ? numkeys * (keysize - leaf.prefixlen)
+                                                      : PackedBytes(numkeys, leaf.width);
+
+    offset = LEAF_HEADER_BYTES;
+    if (len - offset < leaf.prefixlen + leaf.keybytes + 4) {
+        return false;
+    }
+    leaf.prefix = in + offset;
+    offset += leaf.prefixlen;
+    leaf.keys = in + offset;
+    offset += leaf.keybytes;
+    memcpy(&valuebytes, in + offset, 4);
+    offset += 4;
+    if (len - offset != valuebytes) {
+        return false;
+    }
+    leaf.values = in + offset;
+    leaf.valuebytes = valuebytes;
+    return true;
+}
+
+
+//
+// The first want bytes of the rawlen bytes of values
+//
+static bool DecodeValues(const EncodedLeaf &leaf, const SIZE_T rawlen, const SIZE_T want, char *out) {
+    if (leaf.flags & LEAF_VALUES_LZ) {
+        return LZDecompress((const unsigned char *) leaf.values, leaf.valuebytes, (unsigned char *) out, rawlen,
+                            want);
+    }
+    if (leaf.valuebytes != rawlen) {
+        return false;
+    }
+    memcpy(out, leaf.values, want);
+    return true;
+}
+
+
+LeafCodec::LeafCodec(SIZE_T ks, SIZE_T vs) : keysize(ks), valuesize(vs), leavesencoded(0), rawbytes(0),
+                                             encodedbytes(0), leavesdecoded(0), decodenanos(0) { }
+
+
+LeafCodec::~LeafCodec() {
+    // shouldn't have to do anything
+}
+
+
+void LeafCodec::Encode(const char *records, const SIZE_T numkeys, vector<char> &out) const {
+    SIZE_T recsize = keysize + valuesize;
+    SIZE_T prefixlen = 0;
+    SIZE_T suffixlen;
+    unsigned width = 0;
+    unsigned long long base = 0;
+    unsigned long long largest = 0;
+    unsigned valuebytes;
+    vector<unsigned long long> offsets;
+    vector<char> values, lz;
+    const char *first = records;
+    const char *last = records + (numkeys ? numkeys - 1 : 0) * recsize;
+
+    if (numkeys > 0) {
+        while (prefixlen < keysize && prefixlen < LEAF_MAX_PREFIX && first[prefixlen] == last[prefixlen]) {
+            prefixlen++;
+        }
+    }
+    suffixlen = keysize - prefixlen;
+    if (suffixlen <= 8) {
+        base = numkeys ? ReadSuffix(first + prefixlen, suffixlen) : 0;
+        for (SIZE_T i = 0; i < numkeys; i++) {
+            offsets.push_back(ReadSuffix(records + i * recsize + prefixlen, suffixlen) - base);
+            if (offsets.back() > largest) {
+                largest = offsets.back();
+            }
+        }
+        while (width < 64 && (largest >> width) != 0) {
+            width++;
+        }
+    } else {
+        width = LEAF_RAW_SUFFIXES;
+    }
+
+    out.assign(LEAF_HEADER_BYTES, 0);
+    out[1] = (char) prefixlen;
+    out[2] = (char) width;
+    memcpy(&out[3], &base, 8);
+    out.insert(out.end(), first, first + prefixlen);
+    if (width == LEAF_RAW_SUFFIXES) {
+        for (SIZE_T i = 0; i < numkeys; i++) {
+            out.insert(out.end(), records + i * recsize + prefixlen, records + i * recsize + keysize);
+        }
+    } else {
+        out.resize(out.size() + PackedBytes(numkeys, width));
+        if (numkeys > 0 && width > 0) {
+            PackOffsets(offsets, width, &out[out.size() - PackedBytes(numkeys, width)]);
+        }
+    }
+
+    for (SIZE_T i = 0; i < numkeys; i++) {
+        values.insert(values.end(), records + i * recsize + keysize, records + (i + 1) * recsize);
+    }
+    if (!values.empty()) {
+        LZCompress((const unsigned char *) &values[0], values.size(), lz);
+    }
+    if (!values.empty() && lz.size() < values.size()) {
+        out[0] = LEAF_VALUES_LZ;
+        values.swap(lz);
+    }
+    valuebytes = values.size();
+    out.insert(out.end(), (const char *) &valuebytes, (const char *) &valuebytes + 4);
+    out.insert(out.end(), values.begin(), values.end());
+}
+
+
+void LeafCodec::NoteEncoded(const SIZE_T numkeys, const SIZE_T bytes) {
+    leavesencoded++;
+    rawbytes += numkeys * (keysize + valuesize);
+    encodedbytes += bytes;
+}
+
+
+bool LeafCodec::Decode(const char *in, const SIZE_T len, const SIZE_T numkeys, char *records) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    SIZE_T recsize = keysize + valuesize;
+    vector<unsigned long long> offsets;
+    vector<char> values(numkeys * valuesize);
+    EncodedLeaf leaf;
+    char *rec;
+
+    if (!ParseLeaf(in, len, numkeys, keysize, leaf)) {
+        return false;
+    }
+    if (leaf.width != LEAF_RAW_SUFFIXES) {
+        UnpackOffsets(leaf.keys, numkeys, leaf.width, offsets);
+    }
+    // with values of size 0 there is nothing to decode or point at
+    if (values.empty()) {
+        if (leaf.valuebytes != 0) {
+            return false;
+        }
+    } else if (!DecodeValues(leaf, values.size(), values.size(), &values[0])) {
+        return false;
+    }
+    for (SIZE_T i = 0; i < numkeys; i++) {
+        rec = records + i * recsize;
+        memcpy(rec, leaf.prefix, leaf.prefixlen);
+        if (leaf.width == LEAF_RAW_SUFFIXES) {
+            memcpy(rec + leaf.prefixlen, leaf.keys + i * (keysize - leaf.prefixlen), keysize - leaf.prefixlen);
+        } else {
+            WriteSuffix(rec + leaf.prefixlen, keysize - leaf.prefixlen, leaf.base + offsets[i]);
+        }
+        if (!values.empty()) {
+            memcpy(rec + keysize, &values[i * valuesize], valuesize);
+        }
+    }
+
+    leavesdecoded++;
+    decodenanos += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    return true;
+}
+
+
+bool LeafCodec::Find(const char *in, const SIZE_T len, const SIZE_T numkeys, const char *key, char *value,
+                     bool &found) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    SIZE_T suffixlen;
+    SIZE_T position = 0;
+    SIZE_T lo, hi, mid;
+    unsigned long long target;
+    vector<char> values;
+    EncodedLeaf leaf;
+
+    found = false;
+    if (!ParseLeaf(in, len, numkeys, keysize, leaf)) {
+        return false;
+    }
+    // the suffixes are in key order, so binary search them where they
+    // are, packed or raw, for the first that isn't smaller
+    suffixlen = keysize - leaf.prefixlen;
+    if (numkeys > 0 && memcmp(key, leaf.prefix, leaf.prefixlen) == 0) {
+        lo = 0;
+        hi = numkeys;
+        if (leaf.width == LEAF_RAW_SUFFIXES) {
+            while (lo < hi) {
+                mid = lo + (hi - lo) / 2;
+                if (memcmp(leaf.keys + mid * suffixlen, key + leaf.prefixlen, suffixlen) < 0) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            position = lo;
+            found = position < numkeys && memcmp(leaf.keys + position * suffixlen, key + leaf.prefixlen,
+                                                 suffixlen) == 0;
+        } else if (ReadSuffix(key + leaf.prefixlen, suffixlen) >= leaf.base) {
+            target = ReadSuffix(key + leaf.prefixlen, suffixlen) - leaf.base;
+            while (lo < hi) {
+                mid = lo + (hi - lo) / 2;
+                if (PackedOffset(leaf.keys, leaf.width, mid) < target) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            position = lo;
+            found = position < numkeys && PackedOffset(leaf.keys, leaf.width, position) == target;
+        }
+    }
+
+    if (found) {
+        if (leaf.flags & LEAF_VALUES_LZ) {
+            // only as far as the value found.  Values of size 0 are never
+            // compressed.
+            values.resize((position + 1) * valuesize);
+            if (values.empty() || !DecodeValues(leaf, numkeys * valuesize, values.size(), &values[0])) {
+                return false;
+            }
+            memcpy(value, &values[position * valuesize], valuesize);
+        } else {
+            if (leaf.valuebytes != numkeys * valuesize) {
+                return false;
+            }
+            memcpy(value, leaf.values + position * valuesize, valuesize);
+        }
+    }
+
+    leavesdecoded++;
+    decodenanos += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    return true;
+}
+
+
+void LeafCodec::GetStats(LeafCompressionStats &stats) const {
+    stats = LeafCompressionStats();
+    stats.leavesencoded = leavesencoded;
+    stats.rawbytes = rawbytes;
+    stats.encodedbytes = encodedbytes;
+    stats.leavesdecoded = leavesdecoded;
+    stats.decodenanos = decodenanos;
+}
+
+
+void LeafCodec::ResetStats() {
+    leavesencoded = 0;
+    rawbytes = 0;
+    encodedbytes = 0;
+    leavesdecoded = 0;
+    decodenanos = 0;
+}
@@ -0,0 +1,83 @@
+#ifndef _btree_compress
+#define _btree_compress
+
+#include <iostream>
+#include <vector>
+
+#include "global.h"
+#include "block.h"
+
+using namespace std;
+
+// Counters describing how much leaf compression saves and costs
+struct LeafCompressionStats {
+    unsigned long long leavesencoded;
+    unsigned long long rawbytes;          // entry bytes of the leaves encoded
+    unsigned long long encodedbytes;      // what they were encoded into
+    unsigned long long leavesdecoded;     // whole leaves, and single key searches
+    unsigned long long decodenanos;
+
+    LeafCompressionStats();
+
+    double Ratio() const;
+
+    double NanosPerDecode() const;
+
+    ostream &Print(ostream &os) const;
+};
+
+//
+// Encodes the entries of a leaf, numkeys key/value records laid out as in
+// the leaf, into a compact form and back.
+//
+// Keys are sorted, so they all share the common prefix of the first and
+// last key.  It is stored once, and if the rest of each key is at most 8
+// bytes it is read as a big-endian integer (which keeps memcmp order)
+// and stored frame-of-reference: the first key as the base, then every
+// key's distance from it bit-packed at the width of the largest.
+//
+// The values are compressed together with a small byte-oriented
+// LZ77-style codec kept in btree_compress.cc, or kept raw if that doesn't
+// make them smaller.
+//
+class LeafCodec {
+private:
+    SIZE_T keysize;
+    SIZE_T valuesize;
+
+    unsigned long long leavesencoded;
+    unsigned long long rawbytes;
+    unsigned long long encodedbytes;
+    unsigned long long leavesdecoded;
+    unsigned long long decodenanos;
+
+public:
+    LeafCodec(SIZE_T keysize, SIZE_T valuesize);
+
+    virtual ~LeafCodec();
+
+    // replaces out with the encoding of the records
+    void Encode(const char *records, const SIZE_T numkeys, vector<char> &out) const;
+
+    // count an encoding that was stored
+    void NoteEncoded(const SIZE_T numkeys, const SIZE_T encodedbytes);
+
+    // fill in numkeys records from an encoding of len bytes
+    // return false if the encoding is corrupt
+    bool Decode(const char *in, const SIZE_T len, const SIZE_T numkeys, char *records);
+
+    // Look key up in an encoding, searching the keys where they are and
+    // decoding the values only as far as its own
+    // return false if the encoding is corrupt
+    bool Find(const char *in, const SIZE_T len, const SIZE_T numkeys, const char *key, char *value,
+              bool &found);
+
+    void GetStats(LeafCompressionStats &stats) const;
+
+    void ResetStats();
+};
+
+
+inline ostream &operator<<(ostream &os, const LeafCompressionStats &s) { return s.Print(os); }
+
+#endif
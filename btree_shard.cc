@@ -0,0 +1,451 @@
+#include <assert.h>
+#include <string.h>
+#include "btree_shard.h"
+
+BTreeShardRequest::BTreeShardRequest() : op(BTREE_OP_LOOKUP), result(ERROR_NOERROR) { }
+
+
+BTreeShardRequest::BTreeShardRequest(const BTreeOp o, const KEY_T &k, const VALUE_T &v)
+        : op(o), key(k), value(v), result(ERROR_NOERROR) { }
+
+
+ostream &BTreeShardStats::Print(ostream &os) const {
+    os << "BTreeShardedIndex(";
+    for (SIZE_T i = 0; i < ops.size(); i++) {
+        os << (i ? ", " : "") << "shard" << i << "=" << ops[i] << "/" << batches[i];
+    }
+    os << ")";
+    return os;
+}
+
+
+BTreeShardedIndex::BTreeShardedIndex(SIZE_T ks, SIZE_T vs, const vector<BufferCache *> &caches,
+                                     const BTreeShardPolicy p, const vector<KEY_T> &sk)
+        : keysize(ks), valuesize(vs), policy(p), splitkeys(sk), attached(false) {
+    for (SIZE_T i = 0; i < caches.size(); i++) {
+        shards.push_back(new Shard());
+        shards.back()->index = new BTreeIndex(keysize, valuesize, caches[i]);
+    }
+}
+
+
+BTreeShardedIndex::~BTreeShardedIndex() {
+    SIZE_T block;
+
+    // the shards would otherwise lose their pending messages and bloom
+    // filters, there is no one left to report an error to
+    if (attached) {
+        Detach(block);
+    }
+    for (SIZE_T i = 0; i < shards.size(); i++) {
+        delete shards[i]->index;
+        delete shards[i];
+    }
+}
+
+
+ERROR_T BTreeShardedIndex::Attach(const SIZE_T initblock, const bool create) {
+    ERROR_T errorMessage;
+    SIZE_T block;
+
+    // the workers are already running
+    if (attached) {
+        return ERROR_EXISTS;
+    }
+    if (shards.empty() || (policy == BTREE_SHARD_RANGE && splitkeys.size() + 1 != shards.size())) {
+        return ERROR_SIZE;
+    }
+    for (SIZE_T i = 0; i < shards.size(); i++) {
+        if ((errorMessage = shards[i]->index->Attach(initblock, create))) {
+            // detach the shards that did attach, all or none are attached
+            for (SIZE_T j = 0; j < i; j++) {
+                shards[j]->index->Detach(block);
+            }
+            return errorMessage;
+        }
+    }
+    StartWorkers();
+    attached = true;
+    return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeShardedIndex::Detach(SIZE_T &initblock) {
+    ERROR_T errorMessage;
+
+    if (!attached) {
+        return ERROR_NODEVICE;
+    }
+    StopWorkers();
+    attached = false;
+    for (SIZE_T i = 0; i < shards.size(); i++) {
+        if ((errorMessage = shards[i]->index->Detach(initblock))) return errorMessage;
+    }
+    return ERROR_NOERROR;
+}
+
+
+//
+// Hash sharding spreads neighbouring keys over every shard, range
+// sharding keeps them together so that scans touch few shards
+//
+SIZE_T BTreeShardedIndex::ShardFor(const KEY_T &key) const {
+    unsigned long long h;
+    SIZE_T lo, hi, mid;
+
+    if (policy == BTREE_SHARD_RANGE) {
+        // first split key that is not smaller, as in the tree itself
+        lo = 0;
+        hi = splitkeys.size();
+        while (lo < hi) {
+            mid = (lo + hi) / 2;
+            if (splitkeys[mid] < key) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    // FNV-1a with a final mix so that the low bits depend on every byte
+    h = 14695981039346656037ULL;
+    for (SIZE_T i = 0; i < keysize; i++) {
+        h ^= (unsigned char) key.data[i];
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (SIZE_T) (h % shards.size());
+}
+
+
+//
+// Our caller holds the lock of shard
+//
+ERROR_T BTreeShardedIndex::RunRequest(Shard &shard, BTreeShardRequest &request) {
+    shard.ops++;
+    switch (request.op) {
+        case BTREE_OP_INSERT:
+            return shard.index->Insert(request.key, request.value);
+        case BTREE_OP_UPDATE:
+            return shard.index->Update(request.key, request.value);
+        case BTREE_OP_DELETE:
+            return shard.index->Delete(request.key);
+        case BTREE_OP_LOOKUP:
+            return shard.index->Lookup(request.key, request.value);
+        default:
+            return ERROR_INSANE;
+    }
+}
+
+
+void BTreeShardedIndex::WorkerLoop(Shard *shard) {
+    for (;;) {
+        Work work;
+        {
+            unique_lock<mutex> guard(shard->queuelock);
+            while (!shard->stopping && shard->queue.empty()) {
+                shard->queued.wait(guard);
+            }
+            if (shard->queue.empty()) {
+                return;
+            }
+            work = shard->queue.front();
+            shard->queue.pop_front();
+        }
+        {
+            lock_guard<mutex> guard(shard->lock);
+            for (SIZE_T i = 0; i < work.indexes.size(); i++) {
+                BTreeShardRequest &request = (*work.requests)[work.indexes[i]];
+                request.result = RunRequest(*shard, request);
+            }
+            shard->batches++;
+        }
+        // notify with the lock held, Execute may return and destroy the
+        // completion as soon as it is released
+        lock_guard<mutex> guard(work.completion->lock);
+        if (--work.completion->pending == 0) {
+            work.completion->done.notify_all();
+        }
+    }
+}
+
+
+void BTreeShardedIndex::StartWorkers() {
+    for (SIZE_T i = 0; i < shards.size(); i++) {
+        shards[i]->stopping = false;
+        shards[i]->worker = thread(&BTreeShardedIndex::WorkerLoop, this, shards[i]);
+    }
+}
+
+
+//
+// Workers finish what is already queued before they stop
+//
+void BTreeShardedIndex::StopWorkers() {
+    for (SIZE_T i = 0; i < shards.size(); i++) {
+        lock_guard<mutex> guard(shards[i]->queuelock);
+        shards[i]->stopping = true;
+        shards[i]->queued.notify_one();
+    }
+    for (SIZE_T i = 0; i < shards.size(); i++) {
+        shards[i]->worker.join();
+    }
+}
+
+
+ERROR_T BTreeShardedIndex::EnableReadCache(const SIZE_T capacity) {
+    ERROR_T errorMessage;
+
+    if (!attached) {
+        return ERROR_NODEVICE;
+    }
+    for (SIZE_T i = 0; i < shards.size(); i++) {
+        lock_guard<mutex> guard(shards[i]->lock);
+        if ((errorMessage = shards[i]->index->EnableReadCache(capacity))) return errorMessage;
+    }
+    return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeShardedIndex::EnableBloomFilter(const SIZE_T numbits, const SIZE_T numhashes) {
+    ERROR_T errorMessage;
+
+    if (!attached) {
+        return ERROR_NODEVICE;
+    }
+    for (SIZE_T i = 0; i < shards.size(); i++) {
+        lock_guard<mutex> guard(shards[i]->lock);
+        if ((errorMessage = shards[i]->index->EnableBloomFilter(numbits, numhashes))) return errorMessage;
+    }
+    return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeShardedIndex::SetSplitPolicy(const SIZE_T fillpercent, const bool redistribute) {
+    ERROR_T errorMessage;
+
+    if (!attached) {
+        return ERROR_NODEVICE;
+    }
+    for (SIZE_T i = 0; i < shards.size(); i++) {
+        lock_guard<mutex> guard(shards[i]->lock);
+        if ((errorMessage = shards[i]->index->SetSplitPolicy(fillpercent, redistribute))) return errorMessage;
+    }
+    return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeShardedIndex::SetBufferedMode(const bool buffered, const SIZE_T maxfanout) {
+    ERROR_T errorMessage;
+
+    if (!attached) {
+        return ERROR_NODEVICE;
+    }
+    for (SIZE_T i = 0; i < shards.size(); i++) {
+        lock_guard<mutex> guard(shards[i]->lock);
+        if ((errorMessage = shards[i]->index->SetBufferedMode(buffered, maxfanout))) return errorMessage;
+    }
+    return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeShardedIndex::SetLeafCompression(const bool compress) {
+    ERROR_T errorMessage;
+
+    if (!attached) {
+        return ERROR_NODEVICE;
+    }
+    for (SIZE_T i = 0; i < shards.size(); i++) {
+        lock_guard<mutex> guard(shards[i]->lock);
+        if ((errorMessage = shards[i]->index->SetLeafCompression(compress))) return errorMessage;
+    }
+    return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeShardedIndex::Insert(const KEY_T &key, const VALUE_T &value) {
+    if (!attached) {
+        return ERROR_NODEVICE;
+    }
+
+    BTreeShardRequest request(BTREE_OP_INSERT, key, value);
+    Shard &shard = *shards[ShardFor(key)];
+    lock_guard<mutex> guard(shard.lock);
+
+    return RunRequest(shard, request);
+}
+
+
+ERROR_T BTreeShardedIndex::Update(const KEY_T &key, const VALUE_T &value) {
+    if (!attached) {
+        return ERROR_NODEVICE;
+    }
+
+    BTreeShardRequest request(BTREE_OP_UPDATE, key, value);
+    Shard &shard = *shards[ShardFor(key)];
+    lock_guard<mutex> guard(shard.lock);
+
+    return RunRequest(shard, request);
+}
+
+
+ERROR_T BTreeShardedIndex::Delete(const KEY_T &key) {
+    if (!attached) {
+        return ERROR_NODEVICE;
+    }
+
+    BTreeShardRequest request(BTREE_OP_DELETE, key, VALUE_T());
+    Shard &shard = *shards[ShardFor(key)];
+    lock_guard<mutex> guard(shard.lock);
+
+    return RunRequest(shard, request);
+}
+
+
+ERROR_T BTreeShardedIndex::Lookup(const KEY_T &key, VALUE_T &value) {
+    if (!attached) {
+        return ERROR_NODEVICE;
+    }
+
+    BTreeShardRequest request(BTREE_OP_LOOKUP, key, value);
+    Shard &shard = *shards[ShardFor(key)];
+    lock_guard<mutex> guard(shard.lock);
+    ERROR_T errorMessage;
+
+    errorMessage = RunRequest(shard, request);
+    value = request.value;
+    return errorMessage;
+}
+
+
+ERROR_T BTreeShardedIndex::Execute(vector<BTreeShardRequest> &requests) {
+    vector<Work> work(shards.size());
+    Completion completion;
+    ERROR_T errorMessage;
+
+    if (!attached) {
+        return ERROR_NODEVICE;
+    }
+    for (SIZE_T i = 0; i < requests.size(); i++) {
+        work[ShardFor(requests[i].key)].indexes.push_back(i);
+    }
+    for (SIZE_T i = 0; i < shards.size(); i++) {
+        if (!work[i].indexes.empty()) {
+            completion.pending++;
+        }
+    }
+    if (completion.pending == 0) {
+        return ERROR_NOERROR;
+    }
+
+    for (SIZE_T i = 0; i < shards.size(); i++) {
+        if (work[i].indexes.empty()) {
+            continue;
+        }
+        work[i].requests = &requests;
+        work[i].completion = &completion;
+        lock_guard<mutex> guard(shards[i]->queuelock);
+        shards[i]->queue.push_back(work[i]);
+        shards[i]->queued.notify_one();
+    }
+
+    {
+        unique_lock<mutex> guard(completion.lock);
+        while (completion.pending > 0) {
+            completion.done.wait(guard);
+        }
+    }
+
+    errorMessage = ERROR_NOERROR;
+    for (SIZE_T i = 0; i < requests.size() && !errorMessage; i++) {
+        errorMessage = requests[i].result;
+    }
+    return errorMessage;
+}
+
+
+ERROR_T BTreeShardedIndex::Scan(const KEY_T &lo, const SIZE_T maxentries, vector<KeyValuePair> &entries) {
+    ERROR_T errorMessage;
+    vector<vector<KeyValuePair> > found(shards.size());
+    vector<SIZE_T> next(shards.size(), 0);
+    SIZE_T target = entries.size() + maxentries;
+    SIZE_T best;
+
+    if (!attached) {
+        return ERROR_NODEVICE;
+    }
+    if (policy == BTREE_SHARD_RANGE) {
+        // the shards are in key order already, no merging needed
+        for (SIZE_T i = ShardFor(lo); i < shards.size() && entries.size() < target; i++) {
+            lock_guard<mutex> guard(shards[i]->lock);
+            if ((errorMessage = shards[i]->index->Scan(lo, target - entries.size(), entries))) return errorMessage;
+        }
+        return ERROR_NOERROR;
+    }
+
+    // the first maxentries keys overall are among the first maxentries
+    // keys of each shard
+    for (SIZE_T i = 0; i < shards.size(); i++) {
+        lock_guard<mutex> guard(shards[i]->lock);
+        if ((errorMessage = shards[i]->index->Scan(lo, maxentries, found[i]))) return errorMessage;
+    }
+    while (entries.size() < target) {
+        best = shards.size();
+        for (SIZE_T i = 0; i < shards.size(); i++) {
+            if (next[i] < found[i].size() &&
+                (best == shards.size() || found[i][next[i]].key < found[best][next[best]].key)) {
+                best = i;
+            }
+        }
+        if (best == shards.size()) {
+            break;
+        }
+        entries.push_back(found[best][next[best]++]);
+    }
+    return ERROR_NOERROR;
+}
+
+
+//
+// Each shard must be sane and hold only keys routed to it
+//
+ERROR_T BTreeShardedIndex::SanityCheck() {
+    ERROR_T errorMessage;
+    vector<KeyValuePair> entries;
+    KEY_T lo(keysize);
+
+    for (SIZE_T i = 0; i < shards.size(); i++) {
+        lock_guard<mutex> guard(shards[i]->lock);
+        if ((errorMessage = shards[i]->index->SanityCheck())) return errorMessage;
+        // page through the shard, each page starting at the last key of
+        // the previous one
+        memset(lo.data, 0, keysize);
+        do {
+            entries.clear();
+            if ((errorMessage = shards[i]->index->Scan(lo, 1024, entries))) return errorMessage;
+            for (SIZE_T j = 0; j < entries.size(); j++) {
+                if (ShardFor(entries[j].key) != i) {
+                    return ERROR_INSANE;
+                }
+            }
+            if (!entries.empty()) {
+                lo = entries.back().key;
+            }
+        } while (entries.size() == 1024);
+    }
+    return ERROR_NOERROR;
+}
+
+
+void BTreeShardedIndex::GetStats(BTreeShardStats &stats) {
+    stats.ops.clear();
+    stats.batches.clear();
+    for (SIZE_T i = 0; i < shards.size(); i++) {
+        lock_guard<mutex> guard(shards[i]->lock);
+        stats.ops.push_back(shards[i]->ops);
+        stats.batches.push_back(shards[i]->batches);
+    }
+}
@@ -0,0 +1,175 @@
+#ifndef _btree_shard
+#define _btree_shard
+
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "global.h"
+#include "block.h"
+#include "buffercache.h"
+#include "btree.h"
+
+using namespace std;
+
+enum BTreeShardPolicy {
+    BTREE_SHARD_HASH, BTREE_SHARD_RANGE
+};
+
+// One operation of a batch.  value is the input of an insert or update
+// and the output of a lookup; result is set when the batch completes.
+struct BTreeShardRequest {
+    BTreeOp op;
+    KEY_T key;
+    VALUE_T value;
+    ERROR_T result;
+
+    BTreeShardRequest();
+
+    BTreeShardRequest(const BTreeOp op, const KEY_T &key, const VALUE_T &value);
+};
+
+// How the operations were spread over the shards
+struct BTreeShardStats {
+    vector<unsigned long long> ops;       // operations done by each shard
+    vector<unsigned long long> batches;   // batches run by each shard's worker
+
+    ostream &Print(ostream &os) const;
+};
+
+//
+// N independent BTreeIndex instances, each on its own BufferCache and so
+// with its own superblock, free list and root, behind the BTreeIndex
+// point operation API.  Keys go to a shard by hash or by range.
+//
+// Every shard has its own lock, so point operations from different
+// threads on different shards run in parallel.  Execute spreads a batch
+// over per-shard worker threads, each of which runs its part of the
+// batch under a single acquisition of the shard's lock.
+//
+class BTreeShardedIndex {
+private:
+    struct Completion {
+        mutex lock;
+        condition_variable done;
+        SIZE_T pending;
+
+        Completion() : pending(0) { }
+    };
+
+    struct Work {
+        vector<BTreeShardRequest> *requests;
+        vector<SIZE_T> indexes;           // the requests this shard runs
+        Completion *completion;
+    };
+
+    struct Shard {
+        BTreeIndex *index;
+        mutex lock;                       // held while index is in use
+        mutex queuelock;
+        condition_variable queued;
+        deque<Work> queue;
+        thread worker;
+        bool stopping;
+        unsigned long long ops;
+        unsigned long long batches;
+
+        Shard() : index(0), stopping(false), ops(0), batches(0) { }
+    };
+
+    SIZE_T keysize;
+    SIZE_T valuesize;
+    BTreeShardPolicy policy;
+    vector<KEY_T> splitkeys;              // range policy: shard i holds keys <= splitkeys[i]
+    vector<Shard *> shards;
+    bool attached;
+
+    ERROR_T RunRequest(Shard &shard, BTreeShardRequest &request);
+
+    void WorkerLoop(Shard *shard);
+
+    void StartWorkers();
+
+    void StopWorkers();
+
+    // Not copyable, the shards own threads and locks
+    BTreeShardedIndex(const BTreeShardedIndex &rhs);
+
+    BTreeShardedIndex &operator=(const BTreeShardedIndex &rhs);
+
+public:
+    // One shard per cache.  With BTREE_SHARD_RANGE, splitkeys holds one
+    // ascending key fewer than there are caches: shard i gets the keys
+    // greater than splitkeys[i-1] and not greater than splitkeys[i].
+    // Neither the policy nor the split keys are stored on disk, pass the
+    // same ones again to reattach.
+    BTreeShardedIndex(SIZE_T keysize, SIZE_T valuesize, const vector<BufferCache *> &caches,
+                      const BTreeShardPolicy policy = BTREE_SHARD_HASH,
+                      const vector<KEY_T> &splitkeys = vector<KEY_T>());
+
+    // Detaches first if it is still attached
+    virtual ~BTreeShardedIndex();
+
+    // Attach every shard, each with its superblock at initblock of its
+    // own cache, and start the workers
+    // return ERROR_SIZE if the split keys don't match the caches
+    // return ERROR_EXISTS if it is already attached
+    ERROR_T Attach(const SIZE_T initblock, const bool create = false);
+
+    // Stop the workers and detach every shard
+    // return ERROR_NODEVICE if it isn't attached
+    ERROR_T Detach(SIZE_T &initblock);
+
+    SIZE_T GetNumShards() const { return shards.size(); }
+
+    SIZE_T ShardFor(const KEY_T &key) const;
+
+    // Same as on BTreeIndex, on every shard in turn under its lock.
+    // Each shard keeps its own read cache and bloom filter of the given
+    // size.
+    // return ERROR_NODEVICE if it isn't attached
+    // return the first error of any shard, the shards before it have
+    // the new setting
+    ERROR_T EnableReadCache(const SIZE_T capacity);
+
+    ERROR_T EnableBloomFilter(const SIZE_T numbits, const SIZE_T numhashes = 0);
+
+    ERROR_T SetSplitPolicy(const SIZE_T fillpercent, const bool redistribute = true);
+
+    ERROR_T SetBufferedMode(const bool buffered, const SIZE_T maxfanout = 16);
+
+    ERROR_T SetLeafCompression(const bool compress);
+
+    // Same as on BTreeIndex, on the shard that owns key
+    // return ERROR_NODEVICE if it isn't attached
+    ERROR_T Insert(const KEY_T &key, const VALUE_T &value);
+
+    ERROR_T Update(const KEY_T &key, const VALUE_T &value);
+
+    ERROR_T Delete(const KEY_T &key);
+
+    ERROR_T Lookup(const KEY_T &key, VALUE_T &value);
+
+    // Run a batch of requests, each shard's share on its worker thread,
+    // and wait for all of them.  Requests for the same shard run in the
+    // order given, so each key sees its operations in order.
+    // return the first error of any request, or zero
+    ERROR_T Execute(vector<BTreeShardRequest> &requests);
+
+    // Append up to maxentries entries with keys not smaller than lo,
+    // merged across the shards into key order
+    // return ERROR_NODEVICE if it isn't attached
+    ERROR_T Scan(const KEY_T &lo, const SIZE_T maxentries, vector<KeyValuePair> &entries);
+
+    ERROR_T SanityCheck();
+
+    void GetStats(BTreeShardStats &stats);
+};
+
+
+inline ostream &operator<<(ostream &os, const BTreeShardStats &s) { return s.Print(os); }
+
+#endif